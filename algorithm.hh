@@ -52,6 +52,7 @@ struct XCube
 	T& operator[](glm::ivec3 a) { return m_array[index(a)]; }
 	const T* getp(glm::ivec3 a) const { return &m_array[index(a)]; }
 	T* data() { return m_array.data(); }
+	const T* data() const { return m_array.data(); }
 private:
 	int index(glm::ivec3 a) const { assert((uint)a.x < N && (uint)a.y < N && (uint)a.z < N); return a.z*N*N + a.y*N + a.x; }
 private:
@@ -103,102 +104,203 @@ private:
 
 // =================
 
+// Open addressing hash map from ivec3 to V (linear probing), for lookups of superchunks and chunks.
+// Coordinates must fit in 21 bits. Remembers the last hit, as the same key is often looked up many times in a row.
+// Pointers to values are invalidated by insert and erase.
+template<typename V>
+class SpatialMap
+{
+public:
+	SpatialMap() : m_slots(nullptr), m_capacity(0), m_size(0), m_last(0) { rehash(16); }
+	~SpatialMap() { delete[] m_slots; }
+
+	uint size() const { return m_size; }
+
+	V* find(glm::ivec3 a)
+	{
+		uint64_t key = pack(a);
+		if (m_slots[m_last].key == key) return &m_slots[m_last].value;
+		for (uint i = slot(key); m_slots[i].key != Empty; i = (i + 1) & (m_capacity - 1))
+		{
+			if (m_slots[i].key == key)
+			{
+				m_last = i;
+				return &m_slots[i].value;
+			}
+		}
+		return nullptr;
+	}
+
+	// inserts V() if missing
+	V& operator[](glm::ivec3 a)
+	{
+		V* v = find(a);
+		if (v) return *v;
+		if ((m_size + 1) * 2 > m_capacity) rehash(m_capacity * 2);
+		uint64_t key = pack(a);
+		uint i = slot(key);
+		while (m_slots[i].key != Empty) i = (i + 1) & (m_capacity - 1);
+		m_slots[i].key = key;
+		m_slots[i].value = V();
+		m_size += 1;
+		m_last = i;
+		return m_slots[i].value;
+	}
+
+	bool erase(glm::ivec3 a)
+	{
+		if (!find(a)) return false;
+		// shift following entries back, so that no probe sequence is broken
+		uint i = m_last;
+		uint j = i;
+		while (true)
+		{
+			j = (j + 1) & (m_capacity - 1);
+			if (m_slots[j].key == Empty) break;
+			uint k = slot(m_slots[j].key);
+			if (((j - k) & (m_capacity - 1)) >= ((j - i) & (m_capacity - 1)))
+			{
+				m_slots[i] = m_slots[j];
+				i = j;
+			}
+		}
+		m_slots[i].key = Empty;
+		m_size -= 1;
+		return true;
+	}
+
+	void clear()
+	{
+		if (m_size == 0) return;
+		FOR(i, m_capacity) m_slots[i].key = Empty;
+		m_size = 0;
+	}
+
+	// calls f(glm::ivec3 key, V& value) for every entry
+	template<typename F>
+	void for_each(F f)
+	{
+		FOR(i, m_capacity) if (m_slots[i].key != Empty) f(unpack(m_slots[i].key), m_slots[i].value);
+	}
+
+private:
+	SpatialMap(const SpatialMap&) { }
+	void operator=(const SpatialMap&) { }
+
+	static const uint64_t Empty = ~0ull; // pack() never sets the top bit
+
+	struct Slot
+	{
+		uint64_t key;
+		V value;
+	};
+
+	static uint64_t pack(glm::ivec3 a)
+	{
+		assertf(a.x == (a.x << 11 >> 11) && a.y == (a.y << 11 >> 11) && a.z == (a.z << 11 >> 11), "[%d %d %d]", a.x, a.y, a.z);
+		return (uint64_t(a.x & 0x1FFFFF) << 42) | (uint64_t(a.y & 0x1FFFFF) << 21) | uint64_t(a.z & 0x1FFFFF);
+	}
+
+	static glm::ivec3 unpack(uint64_t key)
+	{
+		return glm::ivec3(int(key >> 31) >> 11, int(key >> 10) >> 11, int(key << 11) >> 11);
+	}
+
+	uint slot(uint64_t key) const
+	{
+		// murmur3 finalizer
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdull;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ull;
+		key ^= key >> 33;
+		return key & (m_capacity - 1);
+	}
+
+	void rehash(uint capacity)
+	{
+		Slot* old = m_slots;
+		uint old_capacity = m_capacity;
+		m_slots = new Slot[capacity];
+		m_capacity = capacity;
+		FOR(i, capacity) m_slots[i].key = Empty;
+		FOR(i, old_capacity)
+		{
+			if (old[i].key == Empty) continue;
+			uint j = slot(old[i].key);
+			while (m_slots[j].key != Empty) j = (j + 1) & (m_capacity - 1);
+			m_slots[j] = old[i];
+		}
+		delete[] old;
+		m_last = 0;
+	}
+
+private:
+	Slot* m_slots;
+	uint m_capacity; // power of two
+	uint m_size;
+	uint m_last;
+};
+
+// =================
+
 template<int Bits>
 class BitSet
 {
 public:
-	BitSet() : m_garbage(nullptr), m_last(nullptr) { FOR(i, 64) m_map[i] = nullptr; }
+	BitSet() : m_used(0), m_last(nullptr) { }
 
 	~BitSet()
 	{
-		FOR(i, 64) free_list(m_map[i]);
-		free_list(m_garbage);
+		for (Cube* cube : m_cubes) delete cube;
 	}
 
 	void clear()
 	{
-		FOR(i, 64) while (m_map[i])
-		{
-			Node* p = m_map[i];
-			m_map[i] = p->next;
-			p->next = m_garbage;
-			m_garbage = p;
-		}
+		m_map.clear();
+		m_used = 0;
 		m_last = nullptr;
 	}
 
 	bool xset(glm::ivec3 a)
 	{
-		const int Size = 1 << Bits;
-		const int Mask = Size - 1;
+		const int Mask = (1 << Bits) - 1;
 
 		glm::ivec3 cpos = a >> Bits;
-		if (m_last && m_last->cpos == cpos) return m_last->cube->xset(a & Mask);
-		glm::ivec3 b = cpos & 3;
-		uint index = (b.x * 4 + b.y) * 4 + b.z;
-		for (Node* p = m_map[index]; p; p = p->next)
-		{
-			if (p->cpos == cpos)
-			{
-				m_last = p;
-				return p->cube->xset(a & Mask);
-			}
-		}
+		if (m_last && m_last_cpos == cpos) return m_last->xset(a & Mask);
 
-		Node* q = nullptr;
-		if (m_garbage)
-		{
-			q = m_garbage;
-			m_garbage = q->next;
-		}
-		else
+		Cube*& cube = m_map[cpos];
+		if (!cube)
 		{
-			q = new Node;
-			q->cube = new BitCube<Size>;
+			// cubes are reused after clear()
+			if (m_used == m_cubes.size()) m_cubes.push_back(new Cube);
+			cube = m_cubes[m_used++];
+			cube->clear_all();
 		}
-		q->cpos = cpos;
-		q->cube->clear_all();
-		q->cube->set(a & Mask);
-		m_last = q;
-		q->next = m_map[index];
-		m_map[index] = q;
-		return true;
+		m_last = cube;
+		m_last_cpos = cpos;
+		return cube->xset(a & Mask);
 	}
 
 	uint count()
 	{
 		uint c = 0;
-		FOR(i, 64) for (Node* p = m_map[i]; p; p = p->next) c += p->cube->count();
+		FOR(i, m_used) c += m_cubes[i]->count();
 		return c;
 	}
 
 private:
-	struct Node
-	{
-		BitCube<1 << Bits>* cube;
-		glm::ivec3 cpos;
-		Node* next;
-	};
+	typedef BitCube<1 << Bits> Cube;
 
-private:
 	BitSet(const BitSet& a) { }
 	void operator=(const BitSet& a) { }
 
-	static void free_list(Node* a)
-	{
-		while (a)
-		{
-			Node* p = a->next;
-			a = a->next;
-			delete a->cube;
-			delete a;
-		}
-	}
-
 private:
-	Node* m_garbage;
-	Node* m_last;
-	Node* m_map[64];
+	SpatialMap<Cube*> m_map;
+	std::vector<Cube*> m_cubes;
+	uint m_used;
+	Cube* m_last;
+	glm::ivec3 m_last_cpos;
 };
 
 // =============
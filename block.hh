@@ -7,6 +7,10 @@ const int ChunkSize = 1 << ChunkSizeBits, SuperChunkSize = 1 << SuperChunkSizeBi
 const int CMin = 0, CMax = ChunkSize - 1;
 const int ChunkSizeMask = ChunkSize - 1, SuperChunkSizeMask = SuperChunkSize - 1, MapSizeMask = MapSize - 1;
 
+// in chunks, client renders and server sends chunks up to this distance from player
+const int RenderDistance = 40;
+static_assert(RenderDistance < MapSize / 2, "");
+
 const int ChunkSize2 = ChunkSize * ChunkSize;
 const int ChunkSize3 = ChunkSize * ChunkSize * ChunkSize;
 
@@ -499,3 +503,7 @@ static_assert((uint)BlockTexture::water_flow == 161, "used in shader");
 BlockTexture get_block_texture(Block block, int face);
 
 typedef XCube<ChunkSize, Block> Blocks;
+
+// Index of block inside Blocks::data()
+inline int block_index(glm::ivec3 a) { return (a.z * ChunkSize + a.y) * ChunkSize + a.x; }
+inline glm::ivec3 block_position(int index) { return glm::ivec3(index & ChunkSizeMask, (index >> ChunkSizeBits) & ChunkSizeMask, index >> (2 * ChunkSizeBits)); }
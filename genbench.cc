@@ -0,0 +1,91 @@
+#include "util.hh"
+#include "block.hh"
+#include "algorithm.hh"
+
+// Measures generate_chunk throughput and checks that its output hasn't changed.
+// If output changes on purpose, update GoldenHash with the printed hash.
+
+const uint64_t GoldenHash = 0xa2ace51151c5e725ull;
+
+void generate_chunk(Blocks& chunk, glm::ivec3 cpos);
+void clear_column_cache();
+
+// 4x4x4 chunks at each of the interesting places
+std::vector<glm::ivec3> bench_positions()
+{
+	const glm::ivec3 places[] = {
+		glm::ivec3(-25, -25, 0), // crater
+		glm::ivec3(25, 25, 1), // moon
+		glm::ivec3(0, 0, 0), // showcase
+		glm::ivec3(60, -80, 0), // forest
+		glm::ivec3(-70, 40, 7), // clouds
+		glm::ivec3(-70, 40, 14),
+		glm::ivec3(10, 10, -3), // deep underground
+		glm::ivec3(60, -80, 3),
+		glm::ivec3(30, 30, 20), // sky
+		glm::ivec3(-200, 100, 30),
+	};
+	std::vector<glm::ivec3> list;
+	for (glm::ivec3 c : places) FOR(x, 4) FOR(y, 4) FOR(z, 4) list.push_back(c + glm::ivec3(x, y, z - 1));
+	return list;
+}
+
+// generates all chunks (with cold column cache) and returns chunks per second
+double generate_all(const std::vector<glm::ivec3>& list, std::vector<Blocks>& out, uint threads)
+{
+	clear_column_cache();
+	std::atomic<uint> next(0);
+	auto worker = [&]() {
+		for (uint i = next++; i < list.size(); i = next++) generate_chunk(out[i], list[i]);
+	};
+	Timestamp ta;
+	std::vector<std::thread> pool;
+	FOR(i, int(threads) - 1) pool.push_back(std::thread(worker));
+	worker();
+	for (std::thread& t : pool) t.join();
+	return list.size() / (ta.elapsed_ms() / 1000);
+}
+
+uint64_t hash_all(const std::vector<Blocks>& out)
+{
+	uint64_t h = 0;
+	for (const Blocks& chunk : out) h = CityHash64WithSeed(reinterpret_cast<const char*>(chunk.data()), sizeof(Block) * ChunkSize3, h);
+	return h;
+}
+
+int main(int argc, char** argv)
+{
+	uint threads = (argc > 1) ? atoi(argv[1]) : std::thread::hardware_concurrency();
+	threads = std::max(1u, threads);
+	Timestamp::calibrate();
+
+	std::vector<glm::ivec3> list = bench_positions();
+	std::vector<Blocks> out(list.size());
+
+	const int Rounds = 5;
+	double single = 0, multi = 0;
+	uint64_t h_single = 0, h_multi = 0;
+	FOR(r, Rounds)
+	{
+		single = std::max(single, generate_all(list, out, 1));
+		h_single = hash_all(out);
+		multi = std::max(multi, generate_all(list, out, threads));
+		h_multi = hash_all(out);
+	}
+	printf("%zu chunks, best of %d rounds\n", list.size(), Rounds);
+	printf("  %2u thread  %8.0f chunks/s\n", 1u, single);
+	printf("  %2u threads %8.0f chunks/s\n", threads, multi);
+	printf("hash %016llx (golden %016llx)\n", (unsigned long long)h_single, (unsigned long long)GoldenHash);
+
+	if (h_single != h_multi)
+	{
+		printf("FAIL: multi-threaded output differs (%016llx)\n", (unsigned long long)h_multi);
+		return 1;
+	}
+	if (h_single != GoldenHash)
+	{
+		printf("FAIL: output differs from golden hash\n");
+		return 1;
+	}
+	return 0;
+}
@@ -1,10 +1,13 @@
 #include "ply_io.h"
 #include <unordered_map>
+#include <list>
+#include <condition_variable>
 
 #include "util.hh"
 #include "algorithm.hh"
 #include "rendering.hh"
 #include "block.hh"
+#include "mesher.hh"
 #include "auto.hh"
 #include "socket.hh"
 #include "parse.hh"
@@ -20,57 +23,10 @@ int height;
 
 // Map
 
-const int RenderDistance = 40;
-static_assert(RenderDistance < MapSize / 2, "");
-
 Sphere render_sphere(RenderDistance);
 
 // ============================
 
-namespace Cube
-{
-	glm::ivec3 corner[8];
-	const int faces[6][4] = { { 0, 4, 6, 2 }/*xmin*/, { 1, 3, 7, 5 }/*xmax*/, { 0, 1, 5, 4 }/*ymin*/, { 2, 6, 7, 3 }/*ymax*/, { 0, 2, 3, 1 }/*zmin*/, { 4, 5, 7, 6 }/*zmax*/ };
-	glm::i8vec3 lightmap[6/*face*/][8/*vertex*/][4/*four blocks around vertex affecting light of vertex*/];
-	glm::i8vec3 lightmap2[6/*face*/][8/*vertex*/][4*3/*three blocks around four blocks around vertex affecting light of vertex*/];
-
-	Initialize
-	{
-		FOR(i, 8)
-		{
-			FOR(i, 8) corner[i] = glm::ivec3(i&1, (i>>1)&1, (i>>2)&1);
-			FOR(f, 6)
-			{
-				glm::ivec3 max = corner[i], min = max - ii;
-				if (f % 2 == 0) max[f / 2] -= 1;
-				if (f % 2 == 1) min[f / 2] += 1;
-				int p = 0;
-				int q = 0;
-				FOR2(x, min.x, max.x) FOR2(y, min.y, max.y) FOR2(z, min.z, max.z)
-				{
-					lightmap[f][i][p++] = glm::i8vec3(x, y, z);
-					FOR(ff, 6) if (ff != (f ^ 1))
-					{
-						glm::ivec3 b = glm::ivec3(x, y, z) + face_dir[ff];
-						if (!between(min, b, max)) lightmap2[f][i][q++] = glm::i8vec3(b);
-					}
-					assert(q == p * 3);
-				}
-			}
-		}
-	}
-}
-
-// ============================
-
-struct Quad
-{
-	glm::u8vec3 pos[4]; // TODO: replace with x y w h
-	BlockTexture texture; // highest bit: isUnderwater
-	uint16_t light; // 4 bits per vertex
-	uint16_t plane; // hi byte: plane normal (face), lo byte: plane offset
-};
-
 struct WQuad
 {
 	glm::u16vec3 pos[4]; // TODO: replace with x y w h
@@ -79,401 +35,76 @@ struct WQuad
 	uint16_t plane; // hi byte: plane normal (face), lo byte: plane offset
 };
 
-float distance(const Quad& q, glm::vec3 e)
+// Quad in 8 bytes, expanded to two triangles in shaders/block_pull.vert. Corners are not stored, they follow
+// from face (as in Cube::faces) and rectangle. Only z can be fractional (water).
+// a: light (16 bits), texture (10), underwater (1), face (3)
+// b: x/15 (5), y/15 (5), z (8), extent along u/15 - 1 (4), extent along v (8) [u and v as in BlockRenderer]
+struct PackedQuad
 {
-	glm::vec3 a(q.pos[0]), c(q.pos[2]);
-	return glm::distance2((a + c) * 0.5f, e);
-}
+	uint32_t a, b;
+};
+
+static_assert(block_texture_count <= 1024, "texture has 10 bits in PackedQuad");
 
-bool operator<(const Quad& a, const Quad& b)
+PackedQuad pack(const Quad& q)
 {
-	if (a.texture != b.texture)
-	{
-		int ga = is_blended(a.texture) ? 1 : 0;
-		int gb = is_blended(b.texture) ? 1 : 0;
-		if (ga != gb) return ga < gb;
-		return a.texture < b.texture;
-	}
-	if (a.plane != b.plane) return a.plane < b.plane;
-	return a.light < b.light;
+	int face = q.plane >> 8, axis = face / 2;
+	int u = (axis == 0) ? 1 : 0;
+	int v = (axis == 2) ? 1 : 2;
+	glm::ivec3 lo = glm::min(glm::min(glm::ivec3(q.pos[0]), glm::ivec3(q.pos[1])), glm::min(glm::ivec3(q.pos[2]), glm::ivec3(q.pos[3])));
+	glm::ivec3 hi = glm::max(glm::max(glm::ivec3(q.pos[0]), glm::ivec3(q.pos[1])), glm::max(glm::ivec3(q.pos[2]), glm::ivec3(q.pos[3])));
+	uint texture = uint(q.texture);
+	PackedQuad p;
+	p.a = q.light | ((texture & 0x3FF) << 16) | ((texture >> 15) << 26) | (face << 27);
+	p.b = (lo.x / 15) | ((lo.y / 15) << 5) | (lo.z << 10) | (((hi[u] - lo[u]) / 15 - 1) << 18) | ((hi[v] - lo[v]) << 22);
+	return p;
 }
 
 const float BlockRadius = sqrtf(3) / 2;
 
+// Chunks found by update_render_list, sorted from far to near.
 struct VisibleChunks
 {
-	VisibleChunks() : m_frame(0) { set.clear_all(); }
+	void clear() { array.clear(); }
 
-	void add(glm::ivec3 v)
+	void add(glm::ivec3 cpos)
 	{
-		if (set.xset(v & MapSizeMask))
-		{
-			Element e;
-			e.cpos = v;
-			e.frame = m_frame;
-			array.push_back(e);
-		}
+		Element e;
+		e.cpos = cpos;
+		array.push_back(e);
 	}
 
-	void cleanup()
-	{
-		m_reset_frame = m_frame;
-		set.clear_all();
-	}
-
-	void sort(glm::vec3 camera, bool done)
+	void sort(glm::vec3 camera)
 	{
 		camera -= ii * ChunkSize / 2;
 		camera /= ChunkSize;
-
-		if (done)
-		{
-			int i = 0;
-			while (i < array.size())
-			{
-				if (array[i].frame - m_frame <= m_reset_frame - m_frame)
-				{
-					array[i] = array.back();
-					array.pop_back();
-					continue;
-				}
-				i += 1;
-			}
-
-			for (Element& e : array) e.distance = glm::distance2(glm::vec3(e.cpos), camera);
-			std::sort(array.begin(), array.end());
-		}
-		else
-		{
-			for (Element& e : array) e.distance = glm::distance2(glm::vec3(e.cpos), camera);
-			std::sort(array.begin(), array.end());
-
-			// remove duplicate array entries
-			uint max_age = (m_reset_frame - m_frame + 10);
-			int w = 0;
-			for (int i = 0; i < array.size(); i++)
-			{
-				int j = i + 1;
-				uint frame = array[i].frame;
-				while (j < array.size() && array[i].cpos == array[j].cpos)
-				{
-					if (array[j].frame - m_frame < frame - m_frame) frame = array[j].frame;
-					j += 1;
-				}
-				if (frame - m_frame <= max_age)
-				{
-					array[w].cpos = array[i].cpos;
-					array[w].frame = frame;
-					w += 1;
-				}
-				i = j - 1;
-			}
-			array.resize(w);
-		}
-
-		m_frame -= 1;
+		for (Element& e : array) e.distance = glm::distance2(glm::vec3(e.cpos), camera);
+		std::sort(array.begin(), array.end());
 	}
 
 	struct Element
 	{
 		glm::ivec3 cpos;
 		float distance;
-		uint frame;
 		bool operator<(const Element& b) const { return distance > b.distance; }
 	};
 
-	Element* begin() { return &array[0]; }
+	Element* begin() { return array.data(); }
 	Element* end() { return begin() + array.size(); }
 
 private:
-	uint m_reset_frame;
-	uint m_frame;
-	BitCube<MapSize> set;
 	std::vector<Element> array;
 };
 
+// set when camera moves, or when chunk is loaded or its face connectivity changes
+bool g_render_list_dirty = true;
+
 struct Chunk;
 
 bool enable_f4 = true;
 bool enable_f5 = true;
 bool enable_f6 = true;
 
-uint8_t Light(const Quad& q, int i)
-{
-	int s = (i % 4) * 2;
-	int a = (q.light >> s) & 3;
-	return (a + 1) * 64 - 1;
-}
-
-uint8_t Light2(const Quad& q, int i)
-{
-	int s = (i % 4) * 4;
-	int a = (q.light >> s) & 15;
-	return (a + 1) * 16 - 1;
-}
-
-struct BlockRenderer
-{
-	std::vector<Quad>* m_quads;
-	std::vector<Quad> m_quadsp;
-	glm::ivec3 m_pos;
-	Block m_block;
-
-	std::vector<Quad> m_xy, m_yx;
-
-	// V1
-	glm::ivec3 m_cxpos;
-	const Blocks** m_chunks; // 3x3x3 cube
-
-	// V2
-	// Idea: if mapchunks are shifted 8 blocks on each axis then each render chunk would only depend on 2x2x2 mapchunks (8 instead of 27)
-	// Problem: how to parallelize loading when player moves?
-	// - worker threads only load superchunks and generate chunks (if mapchunk is not ready by buffer time, just use pointer to zero memory or full with some special block types)
-	// - renderchunks are generated by main thread on demand (if chunk is going to be rendered and is dirty)
-	// How does it affect the current and replacement raytracers?/
-	//MapChunkLight m_mcl[3][3][3];
-
-	/*Block get_v2(glm::ivec3 rel)
-	{
-		glm::ivec3 a = m_fpos + rel;
-		glm::ivec3 b = (a - corner) >> ChunkSizeBits;
-		return m_mcl[b.x][b.y][b.z].get(a & ChunkSizeMask);
-	}*/
-
-	Block get(glm::ivec3 rel)
-	{
-		glm::ivec3 a = m_pos + rel;
-		glm::ivec3 b = a >> ChunkSizeBits;
-		assert(-1 <= b.x && b.x <= 1);
-		assert(-1 <= b.y && b.y <= 1);
-		assert(-1 <= b.z && b.z <= 1);
-		int i = b.x*9 + b.y*3 + b.z + 13; // ((b.x+1)*3 + b.y+1)*3 + b.z+1
-		assert((uint)i < 27u);
-		return m_chunks[i] ? (*m_chunks[i])[(a + m_cxpos) & ChunkSizeMask] : Block::none;
-	}
-
-	uint8_t face_light(int face)
-	{
-		const int* f = Cube::faces[face];
-		int q = 0;
-		FOR(i, 4)
-		{
-			glm::i8vec3* map = Cube::lightmap[face][f[i]];
-			int s = 0;
-			FOR(j, 4) if (get(glm::ivec3(map[j])) == Block::none) s += 1;
-			q |= (s - 1) << (i * 2);
-		}
-		return q;
-	}
-
-	uint16_t face_light2(int face)
-	{
-		const int* f = Cube::faces[face];
-		int q = 0;
-		FOR(i, 4)
-		{
-			glm::i8vec3* map = Cube::lightmap[face][f[i]];
-			glm::i8vec3* map2 = Cube::lightmap2[face][f[i]];
-			int s = 0;
-			FOR(j, 4)
-			{
-				Block b = get(glm::ivec3(map[j]));
-				if (can_see_through(b))
-				{
-					s += (b == Block::none) ? 2 : 1;
-					FOR(k, 3)
-					{
-						Block b2 = get(glm::ivec3(map2[j*3+k]));
-						if (can_see_through(b2)) s += (b2 == Block::none) ? 2 : 1;
-					}
-				}
-			}
-			s = s / 2;
-			q |= (s - 1) << (i * 4);
-		}
-		return q;
-	}
-
-	void draw_quad(int face, bool reverse, bool underwater_overlay);
-	void draw_quad(int face, int zmin, int zmax, bool reverse, bool underwater_overlay);
-
-	Block get(int face) { return get(face_dir[face]); }
-
-	template<bool side>
-	void draw_non_water_face(int face)
-	{
-		Block q = get(face);
-		if (side && is_water(q))
-		{
-			if (q == Block::water)
-			{
-				draw_quad(face, false, true);
-			}
-			else if (q != m_block)
-			{
-				draw_quad(face, 0, water_level(q), false, true);
-				draw_quad(face, water_level(q), 15, false, false);
-			}
-			return;
-		}
-		if (!side && q == Block::water)
-		{
-			draw_quad(face, false, true);
-			return;
-		}
-		if (can_see_through(q) && q != m_block)
-		{
-			draw_quad(face, false, false);
-		}
-	}
-
-	void draw_water_side(int face, int w)
-	{
-		Block q = get(face);
-		if (is_water_partial(q))
-		{
-			if (w > water_level(q))
-			{
-				draw_quad(face, water_level(q), w, false, false);
-				draw_quad(face, water_level(q), w, true, false);
-			}
-		}
-		else if (can_see_through_non_water(q))
-		{
-			draw_quad(face, 0, w, false, false);
-			draw_quad(face, 0, w, true, false);
-		}
-	}
-
-	void draw_water_bottom()
-	{
-		Block q = get(/*m_pos.z != CMin, 4,*/ -iz);
-		if (q != Block::water && can_see_through(q)) draw_quad(4, false, false);
-		if (q == Block::none) draw_quad(4, true, false);
-	}
-
-	void draw_water_top(int w)
-	{
-		if (m_block == Block::water)
-		{
-			Block q = get(/*m_pos.z != CMax, 5,*/ iz);
-			if (can_see_through_non_water(q)) draw_quad(5, false, false);
-			if (q == Block::none) draw_quad(5, true, false);
-		}
-		else
-		{
-			draw_quad(5, w, w, false, false);
-			draw_quad(5, w, w, true, false);
-		}
-	}
-
-	void generate_quads(glm::ivec3 cpos, const Blocks* chunks[27], bool merge, std::vector<Quad>& out, int& blended_quads)
-	{
-		out.clear();
-		m_quadsp.clear();
-		m_quads = merge ? &m_quadsp : &out;
-		m_chunks = chunks;
-		m_cxpos = cpos << ChunkSizeBits;
-		const Blocks& mc = *chunks[13];
-		FOR(z, ChunkSize) FOR(y, ChunkSize) FOR(x, ChunkSize)
-		{
-			glm::ivec3 p(x, y, z);
-			Block block = mc[p];
-			if (block == Block::none) continue;
-			m_pos = p;
-			m_block = block;
-
-			if (is_water(block))
-			{
-				int w = uint(block) - uint(Block::water1) + 1;
-				draw_water_side(0, w);
-				draw_water_side(1, w);
-				draw_water_side(2, w);
-				draw_water_side(3, w);
-				draw_water_bottom();
-				draw_water_top(w);
-			}
-			else
-			{
-				draw_non_water_face<true>(0);
-				draw_non_water_face<true>(1);
-				draw_non_water_face<true>(2);
-				draw_non_water_face<true>(3);
-				draw_non_water_face<false>(4);
-				draw_non_water_face<false>(5);
-			}
-		}
-		if (merge) merge_quads(out);
-		if (!merge) std::partition(out.begin(), out.end(), [](const Quad& q) { return !is_blended(q.texture); });
-		blended_quads = 0;
-		while (blended_quads < out.size() && is_blended(out[out.size() - 1 - blended_quads].texture)) blended_quads += 1;
-	}
-
-	static bool combine(Quad& a, Quad b, int X, int Y)
-	{
-		if (a.pos[0][X] == b.pos[0][X] && a.pos[2][X] == b.pos[2][X] && a.pos[2][Y] == b.pos[0][Y])
-		{
-			a.pos[2] = b.pos[2];
-			if (a.pos[1][Y] == b.pos[0][Y]) a.pos[1] = b.pos[1];
-			if (a.pos[3][Y] == b.pos[0][Y]) a.pos[3] = b.pos[3];
-			return true;
-		}
-		return false;
-	}
-
-	static void merge_axis(std::vector<Quad>& quads, int X, int Y)
-	{
-		std::sort(quads.begin(), quads.end(), [X, Y](Quad a, Quad b) { return a.pos[0][X] < b.pos[0][X] || (a.pos[0][X] == b.pos[0][X] && a.pos[0][Y] < b.pos[0][Y]); });
-		int w = 0;
-		for (Quad q : quads)
-		{
-			if (w == 0 || !combine(quads[w-1], q, X, Y)) quads[w++] = q;
-		}
-		quads.resize(w);
-	}
-
-	void merge_quads(std::vector<Quad>& out)
-	{
-		std::sort(m_quadsp.begin(), m_quadsp.end());
-		auto a = m_quadsp.begin();
-		while (a != m_quadsp.end())
-		{
-			auto b = a + 1;
-			while (b != m_quadsp.end() && a->texture == b->texture && a->plane == b->plane && a->light == b->light) b += 1;
-
-			if (is_leaves(a->texture))
-			{
-				while (a < b) out.push_back(*a++);
-				continue;
-			}
-
-			m_xy.clear();
-			m_yx.clear();
-			while (a < b)
-			{
-				m_xy.push_back(*a);
-				m_yx.push_back(*a);
-				a += 1;
-			}
-
-			int axis = m_xy[0].plane >> 9;
-			int x = (axis == 0) ? 1 : 0;
-			int y = (axis == 2) ? 1 : 2;
-
-			merge_axis(m_xy, x, y);
-			merge_axis(m_xy, y, x);
-			merge_axis(m_yx, y, x);
-			merge_axis(m_yx, x, y);
-
-			if (m_xy.size() > m_yx.size()) std::swap(m_xy, m_yx);
-			for (Quad& q : m_xy)
-			{
-				out.push_back(q);
-			}
-		}
-	}
-};
-
 typedef uint64_t CompressedIVec3;
 
 uint64_t compress(int v, int bits)
@@ -768,60 +399,212 @@ void Mesh::bounding_box(glm::vec3& min, glm::vec3& max) const
 
 // ===============
 
+// Level of detail rings: chunks further than lod_distance[i] (in chunks) are meshed with blocks 2^(i+1) times larger.
+// To avoid popping back and forth, level only changes once chunk is LodHysteresis past the ring.
+const int MaxLod = 2;
+std::atomic<int> lod_distance[MaxLod] = { { 12 }, { 24 } }; // set from console
+const float LodHysteresis = 1;
+
+int select_lod(float distance, int lod)
+{
+	int a = 0;
+	while (a < MaxLod && distance > lod_distance[a].load(std::memory_order_relaxed) + ((a < lod) ? -LodHysteresis : LodHysteresis)) a += 1;
+	return a;
+}
+
+const float SortMoveRatio = 1.0f / 32;
+const int SortDistance = 4; // in chunks, further chunks are only sorted as whole (in visible_chunks)
+
+// chunk meshes stay in GPU memory until remeshed
+// with vertex pulling they are stored as PackedQuads, otherwise as Quads for geometry shader
+bool g_vertex_pulling = true;
+BufferArena g_block_arena(sizeof(Quad), 1 << 20);
+const int QuadPage = 16; // also in shaders/block_pull.vert
+BufferArena g_packed_arena(sizeof(PackedQuad), 1 << 20, QuadPage);
+
+BufferArena& block_arena() { return g_vertex_pulling ? g_packed_arena : g_block_arena; }
+
+// origin of chunk by g_packed_arena handle, so that one draw call can render many chunks
+// (vertex shader maps quad -> page -> handle -> origin)
+std::vector<glm::ivec4> g_origins;
+GLuint g_origin_buffer;
+
+void set_origin(uint handle, glm::ivec3 origin)
+{
+	glBindBuffer(GL_TEXTURE_BUFFER, g_origin_buffer);
+	if (handle >= g_origins.size())
+	{
+		g_origins.resize(std::max<size_t>(handle + 1, g_origins.size() * 2));
+		g_origins[handle] = glm::ivec4(origin, 0);
+		glBufferData(GL_TEXTURE_BUFFER, g_origins.size() * sizeof(glm::ivec4), g_origins.data(), GL_STATIC_DRAW);
+		return;
+	}
+	g_origins[handle] = glm::ivec4(origin, 0);
+	glBufferSubData(GL_TEXTURE_BUFFER, handle * sizeof(glm::ivec4), sizeof(glm::ivec4), &g_origins[handle]);
+}
+
 struct Chunk
 {
-	Chunk() : m_cpos(x_bad_ivec3) { }
+	Chunk() : m_meshing(false), m_empty(true), m_cpos(x_bad_ivec3), m_blended_quads(0), m_sorted(false), m_lod(0), m_version(0), m_mesh_version(0), m_dirty(DirtyPlanes::all()), m_connectivity(AllFacesConnected), m_buffer(BufferArena::Null) { }
 
 	Block get(glm::ivec3 a) const { return m_blocks[a]; }
 	const Block* getp(glm::ivec3 a) const { return m_blocks.getp(a); }
 	const Blocks& blocks() const { return m_blocks; }
 	bool empty() const { return m_empty; }
+	// from last mesh, all faces are connected until chunk is meshed
+	uint64_t connectivity() const { return m_connectivity; }
 
+	// Empty chunks aren't in visible_chunks (so they aren't meshed), and their connectivity doesn't change when
+	// they get blocks, so render list has to be searched again.
 	void update_empty()
 	{
-		m_empty = true;
+		bool empty = true;
 		FOR(i, ChunkSize3) if (m_blocks.data()[i] != Block::none)
 		{
-			m_empty = false;
+			empty = false;
 			break;
 		}
+		if (empty != m_empty) g_render_list_dirty = true;
+		m_empty = empty;
 	}
 
+	// Only blended quads are sorted, back to front (and uploaded again if their order changed).
+	// Sorting starts from previous order (usually close, so insertion sort), and is skipped until camera moves
+	// far enough since last sort (relative to its distance from chunk).
 	void sort(glm::vec3 camera)
 	{
-		if (m_blended_quads > 0)
+		if (m_blended_quads == 0) return;
+		camera -= get_cpos() << ChunkSizeBits;
+		if (m_sorted)
 		{
-			camera -= get_cpos() << ChunkSizeBits;
-			auto cmp = [camera](const Quad& a, const Quad& b) { return distance(a, camera) > distance(b, camera); };
-			std::sort(m_quads.end() - m_blended_quads, m_quads.end(), cmp);
+			float move = SortMoveRatio * glm::distance(camera, glm::vec3(ChunkSize / 2));
+			if (glm::distance2(camera, m_sort_camera) <= move * move) return;
 		}
+		m_sorted = true;
+		m_sort_camera = camera;
+
+		static std::vector<float> dist;
+		dist.resize(m_blended_quads);
+		FOR(i, m_blended_quads) dist[i] = glm::distance2(m_centroids[i], camera);
+
+		Quad* quads = &m_quads[m_quads.size() - m_blended_quads];
+		bool moved = false;
+		for (int i = 1; i < m_blended_quads; i++)
+		{
+			if (dist[i - 1] >= dist[i]) continue;
+			float d = dist[i];
+			Quad q = quads[i];
+			glm::vec3 c = m_centroids[i];
+			int j = i;
+			for (; j > 0 && dist[j - 1] < d; j--)
+			{
+				dist[j] = dist[j - 1];
+				quads[j] = quads[j - 1];
+				m_centroids[j] = m_centroids[j - 1];
+			}
+			dist[j] = d;
+			quads[j] = q;
+			m_centroids[j] = c;
+			moved = true;
+		}
+		if (moved) upload(m_quads.size() - m_blended_quads, m_blended_quads);
 	}
 
-	void remesh(BlockRenderer& renderer, const Blocks* chunks[27])
+	// mesh has to be regenerated after chunk or one of its neighbors changes
+	void mark_remesh(const DirtyPlanes& planes = DirtyPlanes::all())
 	{
-		renderer.generate_quads(get_cpos(), chunks, true/*!m_active*/, m_quads, m_blended_quads);
-		m_remesh = false;
+		m_dirty.add(planes);
+		m_version += 1;
 	}
+	bool needs_remesh() const { return m_mesh_version != m_version; }
+	uint version() const { return m_version; }
 
+	// old mesh is drawn until mesh of new level of detail is ready
+	int lod() const { return m_lod; }
+	void set_lod(int lod)
+	{
+		m_lod = lod;
+		mark_remesh();
+	}
+	const std::vector<Quad>& quads() const { return m_quads; }
+
+	// planes changed since last mesh job was submitted
+	DirtyPlanes take_dirty()
+	{
+		DirtyPlanes d = m_dirty;
+		m_dirty = DirtyPlanes::none();
+		return d;
+	}
+
+	// swaps in mesh generated from snapshot of chunk at version
+	void set_mesh(std::vector<Quad>& quads, int blended_quads, uint64_t connectivity, uint version)
+	{
+		if (connectivity != m_connectivity) g_render_list_dirty = true;
+		m_connectivity = connectivity;
+		std::swap(m_quads, quads);
+		m_blended_quads = blended_quads;
+		m_centroids.resize(blended_quads);
+		FOR(i, blended_quads) m_centroids[i] = centroid(m_quads[m_quads.size() - blended_quads + i]);
+		m_sorted = false;
+		m_mesh_version = version;
+		free_buffer();
+		if (m_quads.size() > 0)
+		{
+			m_buffer = block_arena().alloc(m_quads.size());
+			if (g_vertex_pulling) set_origin(m_buffer, m_cpos * ChunkSize);
+			upload(0, m_quads.size());
+		}
+	}
+
+	// appends draw range of opaque (or blended) quads to batch for glMultiDrawArrays (vertex pulling only)
+	int batch(bool blended, std::vector<GLint>& first, std::vector<GLsizei>& count)
+	{
+		int opaque = m_quads.size() - m_blended_quads;
+		int n = blended ? m_blended_quads : opaque;
+		if (n == 0) return 0;
+		first.push_back((g_packed_arena.offset(m_buffer) + (blended ? opaque : 0)) * 6);
+		count.push_back(n * 6);
+		return n;
+	}
+
+	// expects g_block_arena to be bound (geometry shader path)
 	int render()
 	{
-		glBufferData(GL_ARRAY_BUFFER, sizeof(Quad) * m_quads.size(), &m_quads[0], GL_STREAM_DRAW);
-		glDrawArrays(GL_POINTS, 0, m_quads.size());
+		if (m_quads.size() == 0) return 0;
+		glDrawArrays(GL_POINTS, g_block_arena.offset(m_buffer), m_quads.size());
 		return m_quads.size();
 	}
 
+	void update(const BlockUpdate* updates, int count)
+	{
+		FOR(i, count) m_blocks.data()[updates[i].index] = updates[i].block;
+		update_empty();
+	}
+
+	// keeps the mesh, caller marks changed planes
+	void update(const Block blocks[ChunkSize3])
+	{
+		memcpy(m_blocks.data(), blocks, sizeof(Block) * ChunkSize3);
+		update_empty();
+	}
+
 	void init(glm::ivec3 cpos, Block blocks[ChunkSize3])
 	{
 		memcpy(m_blocks.data(), blocks, sizeof(Block) * ChunkSize3);
 		update_empty();
 		m_quads.clear();
+		m_blended_quads = 0;
+		m_centroids.clear();
+		free_buffer();
 		m_cpos = cpos;
-		m_remesh = true;
+		m_connectivity = AllFacesConnected;
+		mark_remesh();
+		g_render_list_dirty = true;
 	}
 
 	glm::ivec3 get_cpos() { return m_cpos; }
 
-	bool m_remesh;
+	bool m_meshing; // mesh job in flight (for whichever chunk is in this slot)
 	friend class Chunks;
 private:
 	bool m_empty;
@@ -829,6 +612,34 @@ private:
 	glm::ivec3 m_cpos;
 	std::vector<Quad> m_quads;
 	int m_blended_quads;
+	std::vector<glm::vec3> m_centroids; // of blended quads, in same order
+	glm::vec3 m_sort_camera; // camera position at last sort
+	bool m_sorted;
+	int m_lod;
+	uint m_version, m_mesh_version;
+	DirtyPlanes m_dirty;
+	uint64_t m_connectivity;
+	uint m_buffer; // in block_arena()
+
+	void free_buffer()
+	{
+		if (m_buffer == BufferArena::Null) return;
+		block_arena().free(m_buffer);
+		m_buffer = BufferArena::Null;
+	}
+
+	void upload(uint first, uint count)
+	{
+		if (!g_vertex_pulling)
+		{
+			g_block_arena.upload(m_buffer, first, count, &m_quads[first]);
+			return;
+		}
+		static std::vector<PackedQuad> packed;
+		packed.resize(count);
+		FOR(i, count) packed[i] = pack(m_quads[first + i]);
+		g_packed_arena.upload(m_buffer, first, count, &packed[0]);
+	}
 };
 
 class Chunks
@@ -883,7 +694,7 @@ Chunks g_chunks;
 
 // ======================
 
-void server_main();
+void server_main(const char* record_path);
 Socket g_client;
 SocketBuffer g_recv_buffer;
 SocketBuffer g_send_buffer;
@@ -927,177 +738,56 @@ void rasterize_mesh(const Mesh& mesh, glm::ivec3 base, float scale, Block block)
 
 // ======================
 
-struct Direction
-{
-	glm::vec3 dir;
-	glm::vec3 inv_dir;
-};
-
-struct Directions : public std::vector<Direction>
-{
-	enum { Bits = 9 };
-	Directions()
-	{
-		const int M = 1 << Bits, N = M - 1;
-		FOR2(x, 1, M) FOR2(y, 1, M) for(int z = 1; z <= M; z++)
-		{
-			int d2 = x*x + y*y + z*z;
-			if (N*N < d2 && d2 <= M*M) for (int i : {-x, x}) for (int j : {-y, y})
-			{
-				add(i, j, z);
-				add(i, j, -z);
-			}
-		}
-		for (int m : {M, -M})
-		{
-			add(m, 0, 0);
-			add(0, m, 0);
-			add(0, 0, m);
-		}
-		FOR(i, size()) std::swap(operator[](std::rand() % size()), operator[](i));
-	}
-	void add(int x, int y, int z)
-	{
-		Direction e;
-		e.dir = glm::normalize(glm::vec3(x, y, z));
-		e.inv_dir = glm::abs(1.0f / e.dir);
-		push_back(e);
-	}
-} directions;
-
-int ray_it = 0;
-int rays_remaining = 0;
-
 VisibleChunks visible_chunks;
 
-void raytrace(Chunk* chunk, glm::ivec3 pos, glm::ivec3 cpos, const Block* bp, glm::ivec3 id, glm::vec3 dd, glm::vec3 crossing)
+// Which chunks can be seen from camera? Breadth first search from camera chunk. Chunk is entered through a face,
+// and left only through faces connected to it (by see-through blocks inside chunk), and never in direction opposite
+// to one taken before (so that path can't bend back towards camera). Missing chunks and chunks outside of frustum
+// or render distance are not entered.
+void update_render_list(const Frustum& frustum)
 {
-	const float MaxDist = RenderDistance * ChunkSize;
-
-	while (true)
-	{
-		if (crossing.x < crossing.y)
-		{
-			if (crossing.x < crossing.z)
-			{
-				if (crossing.x > MaxDist) return;
-				pos.x += id.x;
-				crossing.x += dd.x;
-				if (cpos.x != (pos.x >> ChunkSizeBits)) { cpos.x = pos.x >> ChunkSizeBits; goto next_chunk; }
-				bp += id.x;
-			}
-			else
-			{
-				if (crossing.z > MaxDist) return;
-				pos.z += id.z;
-				crossing.z += dd.z;
-				if (cpos.z != (pos.z >> ChunkSizeBits)) { cpos.z = pos.z >> ChunkSizeBits; goto next_chunk; }
-				bp += id.z * ChunkSize2;
-			}
-		}
-		else
-		{
-			if (crossing.y < crossing.z)
-			{
-				if (crossing.y > MaxDist) return;
-				pos.y += id.y;
-				crossing.y += dd.y;
-				if (cpos.y != (pos.y >> ChunkSizeBits)) { cpos.y = pos.y >> ChunkSizeBits; goto next_chunk; }
-				bp += id.y * ChunkSize;
-			}
-			else
-			{
-				if (crossing.z > MaxDist) return;
-				pos.z += id.z;
-				crossing.z += dd.z;
-				if (cpos.z != (pos.z >> ChunkSizeBits)) { cpos.z = pos.z >> ChunkSizeBits; goto next_chunk; }
-				bp += id.z * ChunkSize2;
-			}
-		}
-
-		resume:
-		Block block = *bp;
-		if (block != Block::none)
-		{
-			visible_chunks.add(cpos);
-			if (!can_see_through(block)) return;
-		}
-	}
+	if (!g_render_list_dirty) return;
+	// camera chunk isn't loaded yet: keep previous list, and search again next frame
+	glm::ivec3 cplayer = glm::ivec3(glm::floor(g_player.position)) >> ChunkSizeBits;
+	Chunk* camera = g_chunks.get_opt(cplayer);
+	if (!camera) return;
+	g_render_list_dirty = false;
 
-next_chunk:
-	chunk = &g_chunks.get(cpos);
-	if (chunk->get_cpos() != cpos) return;
-	if (!chunk->empty())
+	struct Step
 	{
-		bp = chunk->getp(pos & ChunkSizeMask);
-		goto resume;
-	}
-
-	while (true)
-	{
-		if (crossing.x < crossing.y && crossing.x < crossing.z)
-		{
-			if (crossing.x > MaxDist) return;
-			pos.x += id.x;
-			crossing.x += dd.x;
-			if (cpos.x != (pos.x >> ChunkSizeBits)) { cpos.x = pos.x >> ChunkSizeBits; goto next_chunk; }
-		}
-		else if (crossing.y < crossing.z)
-		{
-			if (crossing.y > MaxDist) return;
-			pos.y += id.y;
-			crossing.y += dd.y;
-			if (cpos.y != (pos.y >> ChunkSizeBits)) { cpos.y = pos.y >> ChunkSizeBits; goto next_chunk; }
-		}
-		else
-		{
-			if (crossing.z > MaxDist) return;
-			pos.z += id.z;
-			crossing.z += dd.z;
-			if (cpos.z != (pos.z >> ChunkSizeBits)) { cpos.z = pos.z >> ChunkSizeBits; goto next_chunk; }
-		}
-	}
-}
-
-// which chunks must be rendered from the center chunk?
-void update_render_list(Frustum& frustum)
-{
-	if (rays_remaining == 0) return;
-
-	glm::vec3 origin = g_player.position;
-	glm::ivec3 pos = glm::ivec3(glm::floor(origin));
-	glm::ivec3 cpos = pos >> ChunkSizeBits;
-	Chunk* chunk = &g_chunks.get(cpos);
-	assert(chunk->get_cpos() == cpos);
-
-	int64_t budget = 40 / Timestamp::milisec_per_tick;
-	Timestamp ta;
-
-	const Block* bp = chunk->getp(pos & ChunkSizeMask);
-
-	glm::vec3 crossingA = glm::ceil(origin) - origin;
-	glm::vec3 crossingB = origin - glm::floor(origin);
+		Chunk* chunk;
+		glm::ivec3 cpos;
+		int entry; // face through which chunk was entered, -1 for camera chunk
+		uint directions; // bit mask of faces, through which path has left chunks so far
+	};
+	static std::vector<Step> queue;
+	static BitCube<MapSize> visited;
+	queue.clear();
+	visited.clear_all();
+	visible_chunks.clear();
 
-	int q = 0;
-	while (rays_remaining > 0)
+	queue.push_back(Step{ camera, cplayer, -1, 0 });
+	visited.set(cplayer & MapSizeMask);
+	for (size_t i = 0; i < queue.size(); i++)
 	{
-		const Direction& e = directions[ray_it++];
-		if (ray_it == directions.size()) ray_it = 0;
-		rays_remaining -= 1;
-		if (frustum.contains_point(g_player.position + e.dir))
+		Step s = queue[i];
+		if (!s.chunk->empty()) visible_chunks.add(s.cpos);
+		uint64_t connectivity = s.chunk->connectivity();
+		FOR(face, 6)
 		{
-			glm::ivec3 id;
-			glm::vec3 crossing;
-			FOR(i, 3)
-			{
-				id[i] = (e.dir[i] > 0) ? 1 : -1;
-				crossing[i] = (e.inv_dir[i] == INFINITY) ? INFINITY : ((e.dir[i] > 0 ? crossingA[i] : crossingB[i]) * e.inv_dir[i]);
-			}
-			raytrace(chunk, pos, cpos, bp, id, e.inv_dir, crossing);
+			if (s.directions & (1u << (face ^ 1))) continue;
+			if (s.entry != -1 && !faces_connected(connectivity, s.entry, face)) continue;
+			glm::ivec3 cpos = s.cpos + face_dir[face];
+			if (!visited.xset(cpos & MapSizeMask)) continue;
+			glm::ivec3 d = cpos - cplayer;
+			if (glm::dot(d, d) > RenderDistance * RenderDistance) continue;
+			Chunk* chunk = g_chunks.get_opt(cpos);
+			if (!chunk) continue;
+			if (frustum.is_sphere_outside(glm::vec3(cpos * ChunkSize + ChunkSize / 2), ChunkSize * BlockRadius)) continue;
+			queue.push_back(Step{ chunk, cpos, face ^ 1, s.directions | (1u << face) });
 		}
-		if ((q++ % 1024) == 0 && ta.elapsed() > budget) break;
 	}
-	visible_chunks.sort(g_player.position, rays_remaining == 0);
+	visible_chunks.sort(g_player.position);
 }
 
 namespace stats
@@ -1108,7 +798,7 @@ namespace stats
 	float frame_time_ms = 0;
 	float render_time_ms = 0;
 	float model_time_ms = 0;
-	float raytrace_time_ms = 0;
+	float visibility_time_ms = 0;
 
 	float collide_time_ms = 0;
 	float select_time_ms = 0;
@@ -1713,7 +1403,7 @@ void model_move_player(GLFWwindow* window, float dt)
 	}
 	if (p != g_player.position)
 	{
-		rays_remaining = directions.size();
+		g_render_list_dirty = true;
 		g_player.broadcasted = false;
 	}
 }
@@ -1817,7 +1507,7 @@ void model_orientation(GLFWwindow* window)
 		perspective_rotation = glm::rotate(perspective, g_player.pitch, glm::vec3(1, 0, 0));
 		perspective_rotation = glm::rotate(perspective_rotation, g_player.yaw, glm::vec3(0, 1, 0));
 		perspective_rotation = glm::rotate(perspective_rotation, float(M_PI / 2), glm::vec3(-1, 0, 0));
-		rays_remaining = directions.size();
+		g_render_list_dirty = true;
 	}
 }
 
@@ -1858,7 +1548,6 @@ void model_frame(GLFWwindow* window, double delta_ms)
 	selection = select_cube(/*out*/sel_cube, /*out*/sel_face);
 	Timestamp tc;
 	model_digging(window);
-	visible_chunks.cleanup();
 
 	stats::collide_time_ms = glm::mix<float>(stats::collide_time_ms, ta.elapsed_ms(tb), 0.15f);
 	stats::select_time_ms = glm::mix<float>(stats::select_time_ms, tb.elapsed_ms(tc), 0.15f);
@@ -1888,6 +1577,19 @@ GLuint block_texture_loc;
 GLuint block_light_loc;
 GLuint block_plane_loc;
 
+// vertex pulling: quads are read from g_packed_arena through buffer texture
+int block_pull_program;
+GLuint block_pull_matrix_loc;
+GLuint block_pull_tick_loc;
+GLuint block_pull_foglimit2_loc;
+GLuint block_pull_eye_loc;
+GLuint block_pull_quads_loc;
+GLuint block_pull_pages_loc;
+GLuint block_pull_origins_loc;
+GLuint block_quads_texture;
+GLuint block_pages_texture;
+GLuint block_origins_texture;
+
 int mesh_program;
 GLuint mesh_matrix_loc;
 GLuint mesh_sampler_loc;
@@ -2045,7 +1747,7 @@ void render_init()
 	perspective_rotation = glm::rotate(perspective, g_player.pitch, glm::vec3(1, 0, 0));
 	perspective_rotation = glm::rotate(perspective_rotation, g_player.yaw, glm::vec3(0, 1, 0));
 	perspective_rotation = glm::rotate(perspective_rotation, float(M_PI / 2), glm::vec3(-1, 0, 0));
-	rays_remaining = directions.size();
+	g_render_list_dirty = true;
 	last_cursor_init = false;
 	text = new Text;
 
@@ -2069,6 +1771,35 @@ void render_init()
 	block_light_loc = get_attrib_location(block_program, "light");
 	block_plane_loc = get_attrib_location(block_program, "plane");
 
+	GLint max_texels;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+	if (g_vertex_pulling && max_texels < (1 << 24))
+	{
+		fprintf(stderr, "GL_MAX_TEXTURE_BUFFER_SIZE is only %d, using geometry shader\n", max_texels);
+		g_vertex_pulling = false;
+	}
+	if (g_vertex_pulling)
+	{
+		block_pull_program = load_program("block_pull", "block");
+		block_pull_matrix_loc = get_uniform_location(block_pull_program, "matrix");
+		block_pull_tick_loc = get_uniform_location(block_pull_program, "tick");
+		block_pull_foglimit2_loc = get_uniform_location(block_pull_program, "foglimit2");
+		block_pull_eye_loc = get_uniform_location(block_pull_program, "eye");
+		block_pull_quads_loc = get_uniform_location(block_pull_program, "quads");
+		block_pull_pages_loc = get_uniform_location(block_pull_program, "pages");
+		block_pull_origins_loc = get_uniform_location(block_pull_program, "origins");
+		glUseProgram(block_pull_program);
+		glUniform1i(block_pull_quads_loc, 1); // texture units
+		glUniform1i(block_pull_pages_loc, 2);
+		glUniform1i(block_pull_origins_loc, 3);
+		glUseProgram(0);
+		glGenTextures(1, &block_quads_texture);
+		glGenTextures(1, &block_pages_texture);
+		glGenTextures(1, &block_origins_texture);
+		glGenBuffers(1, &g_origin_buffer);
+		set_origin(0, glm::ivec3(0));
+	}
+
 	mesh_program = load_program("mesh");
 	mesh_matrix_loc = get_uniform_location(mesh_program, "matrix");
 	mesh_sampler_loc = get_uniform_location(mesh_program, "sampler");
@@ -2084,6 +1815,7 @@ void render_init()
 
 	glGenBuffers(1, &line_buffer);
 	glGenBuffers(1, &block_buffer);
+	block_arena().init();
 	glGenBuffers(1, &mesh_buffer);
 
 	GLuint vao;
@@ -2131,98 +1863,315 @@ void render_init()
 	}
 }
 
-void BlockRenderer::draw_quad(int face, bool reverse, bool underwater_overlay)
+// ======================
+
+// Chunks are meshed on worker threads, each with its own BlockRenderer. Main thread takes a snapshot of chunk
+// and its 26 neighbors (so workers never touch g_chunks), and later swaps finished meshes in, nearest first.
+struct MeshJob
 {
-	Quad q;
-	q.texture = get_block_texture(m_block, face);
-	if (underwater_overlay) q.texture = BlockTexture((int)q.texture | (1 << 15));
-	const int* f = Cube::faces[face];
-	q.light = face_light2(face); // TODO reverse?
-	glm::ivec3 w = m_pos & ChunkSizeMask;
-	if (reverse)
+	glm::ivec3 cpos;
+	uint version; // of chunk when snapshot was taken
+	float distance; // from camera
+	Blocks blocks[27];
+	const Blocks* chunks[27]; // pointers into blocks, nullptr for missing or empty neighbors
+	int lod;
+	DirtyPlanes dirty;
+	std::vector<Quad> old_quads; // current mesh of chunk, if only some planes are dirty
+	std::vector<Quad> quads;
+	int blended_quads;
+	uint64_t connectivity; // of chunk faces, see face_connectivity
+};
+
+// Finished meshes by hash of their neighborhood, so that chunks which come back (or neighborhoods that are
+// sent again unchanged) are not meshed again. Least recently used meshes are dropped over byte budget.
+class MeshCache
+{
+public:
+	MeshCache(size_t budget) : m_budget(budget), m_bytes(0), m_hits(0), m_misses(0) { }
+
+	bool get(uint64_t key, std::vector<Quad>& quads, int& blended_quads)
 	{
-		q.pos[0] = glm::u8vec3((w + Cube::corner[f[0]]) * 15);
-		q.pos[1] = glm::u8vec3((w + Cube::corner[f[3]]) * 15);
-		q.pos[2] = glm::u8vec3((w + Cube::corner[f[2]]) * 15);
-		q.pos[3] = glm::u8vec3((w + Cube::corner[f[1]]) * 15);
-		q.plane = ((face ^ 1) << 8) | q.pos[0][face / 2];
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_map.find(key);
+		if (it == m_map.end())
+		{
+			m_misses += 1;
+			return false;
+		}
+		m_hits += 1;
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		quads = it->second->quads;
+		blended_quads = it->second->blended_quads;
+		return true;
 	}
-	else
+
+	void put(uint64_t key, const std::vector<Quad>& quads, int blended_quads)
 	{
-		q.pos[0] = glm::u8vec3((w + Cube::corner[f[0]]) * 15);
-		q.pos[1] = glm::u8vec3((w + Cube::corner[f[1]]) * 15);
-		q.pos[2] = glm::u8vec3((w + Cube::corner[f[2]]) * 15);
-		q.pos[3] = glm::u8vec3((w + Cube::corner[f[3]]) * 15);
-		q.plane = (face << 8) | q.pos[0][face / 2];
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_map.count(key)) return;
+		m_lru.push_front(Entry{key, quads, blended_quads});
+		m_map[key] = m_lru.begin();
+		m_bytes += bytes(m_lru.front());
+		while (m_bytes > m_budget)
+		{
+			m_bytes -= bytes(m_lru.back());
+			m_map.erase(m_lru.back().key);
+			m_lru.pop_back();
+		}
+	}
+
+	uint hits() const { return m_hits; }
+	uint misses() const { return m_misses; }
+	size_t bytes() const { return m_bytes; }
+
+private:
+	struct Entry
+	{
+		uint64_t key;
+		std::vector<Quad> quads;
+		int blended_quads;
+	};
+
+	static size_t bytes(const Entry& e) { return sizeof(Entry) + e.quads.size() * sizeof(Quad); }
+
+	const size_t m_budget;
+	// written under m_mutex, but also read by main thread for stats
+	std::atomic<size_t> m_bytes;
+	std::atomic<uint> m_hits, m_misses;
+	std::mutex m_mutex;
+	std::list<Entry> m_lru; // most recently used first
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> m_map;
+};
+
+MeshCache g_mesh_cache(64 << 20);
+
+class Mesher
+{
+public:
+	Mesher() : m_jobs(0) { }
+
+	void start(int threads)
+	{
+		FOR(i, threads) std::thread([this]() { worker(); }).detach();
+	}
+
+	// main thread only
+	int jobs() const { return m_jobs; }
+
+	MeshJob* alloc()
+	{
+		m_jobs += 1;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_free.empty()) return new MeshJob;
+		MeshJob* job = m_free.back();
+		m_free.pop_back();
+		return job;
+	}
+
+	void submit(MeshJob* job)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queue.push_back(job);
+		std::push_heap(m_queue.begin(), m_queue.end(), further);
+		m_cond.notify_one();
+	}
+
+	// appends finished jobs to out
+	void collect(std::vector<MeshJob*>& out)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		out.insert(out.end(), m_done.begin(), m_done.end());
+		m_done.clear();
+	}
+
+	void release(MeshJob* job)
+	{
+		m_jobs -= 1;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_free.push_back(job);
 	}
-	m_quads->push_back(q);
-}
 
-static glm::ivec3 adjust(glm::ivec3 v, int zmin, int zmax)
+private:
+	static bool further(const MeshJob* a, const MeshJob* b) { return a->distance > b->distance; }
+
+	void worker()
+	{
+		BlockRenderer renderer;
+		while (true)
+		{
+			MeshJob* job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cond.wait(lock, [this]() { return !m_queue.empty(); });
+				std::pop_heap(m_queue.begin(), m_queue.end(), further);
+				job = m_queue.back();
+				m_queue.pop_back();
+			}
+			job->connectivity = face_connectivity(*job->chunks[13]);
+			if (job->lod > 0)
+			{
+				renderer.generate_lod_quads(job->chunks, job->lod, job->quads, job->blended_quads);
+			}
+			else
+			{
+				uint64_t key = renderer.neighborhood_hash(job->chunks);
+				if (!g_mesh_cache.get(key, job->quads, job->blended_quads))
+				{
+					if (job->dirty.full())
+					{
+						renderer.generate_quads(job->cpos, job->chunks, true, job->quads, job->blended_quads);
+					}
+					else
+					{
+						renderer.regenerate_quads(job->cpos, job->chunks, job->dirty, job->old_quads, job->quads, job->blended_quads);
+					}
+					g_mesh_cache.put(key, job->quads, job->blended_quads);
+				}
+			}
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_done.push_back(job);
+		}
+	}
+
+	int m_jobs;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::vector<MeshJob*> m_queue; // heap, nearest first
+	std::vector<MeshJob*> m_done;
+	std::vector<MeshJob*> m_free;
+};
+
+Mesher g_mesher;
+
+const int MaxMeshJobs = 256; // each job holds 27 chunks
+float mesh_budget_ms = 2; // per frame, for swapping in finished meshes
+
+void swap_meshes()
 {
-	return glm::ivec3(v.x * 15, v.y * 15, (v.z == 0) ? zmin : zmax);
+	static std::vector<MeshJob*> done;
+	g_mesher.collect(done);
+	std::sort(done.begin(), done.end(), [](const MeshJob* a, const MeshJob* b) { return a->distance < b->distance; });
+
+	Timestamp ta;
+	size_t i = 0;
+	for (; i < done.size(); i++)
+	{
+		if (i > 0 && ta.elapsed_ms() > mesh_budget_ms) break;
+		MeshJob* job = done[i];
+		Chunk& chunk = g_chunks.get(job->cpos);
+		if (chunk.get_cpos() == job->cpos) chunk.set_mesh(job->quads, job->blended_quads, job->connectivity, job->version);
+		chunk.m_meshing = false;
+		g_mesher.release(job);
+	}
+	done.erase(done.begin(), done.begin() + i);
 }
 
-void BlockRenderer::draw_quad(int face, int zmin, int zmax, bool reverse, bool underwater_overlay)
+void submit_mesh_job(Chunk& chunk, float distance)
 {
-	Quad q;
-	q.texture = get_block_texture(m_block, face);
-	if (underwater_overlay) q.texture = BlockTexture((int)q.texture | (1 << 15));
-	const int* f = Cube::faces[face];
-	q.light = face_light2(face); // TODO zmin/zmax? // TODO reverse?
-	glm::ivec3 w = m_pos & ChunkSizeMask;
-	if (reverse)
+	glm::ivec3 cpos = chunk.get_cpos();
+	DirtyPlanes dirty = chunk.take_dirty();
+	if (chunk.empty())
 	{
-		q.pos[0] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[0]], zmin, zmax));
-		q.pos[1] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[3]], zmin, zmax));
-		q.pos[2] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[2]], zmin, zmax));
-		q.pos[3] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[1]], zmin, zmax));
-		q.plane = ((face ^ 1) << 8) | q.pos[0][face / 2];
+		static std::vector<Quad> empty;
+		empty.clear();
+		chunk.set_mesh(empty, 0, AllFacesConnected, chunk.version());
+		return;
 	}
-	else
+
+	MeshJob* job = g_mesher.alloc();
+	job->cpos = cpos;
+	job->version = chunk.version();
+	job->distance = distance;
+	job->lod = chunk.lod();
+	job->dirty = dirty;
+	job->old_quads.clear();
+	if (job->lod == 0 && !dirty.full()) job->old_quads = chunk.quads();
+	FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1)
 	{
-		q.pos[0] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[0]], zmin, zmax));
-		q.pos[1] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[1]], zmin, zmax));
-		q.pos[2] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[2]], zmin, zmax));
-		q.pos[3] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[3]], zmin, zmax));
-		q.plane = (face << 8) | q.pos[0][face / 2];
+		int i = x*9 + y*3 + z + 13;
+		Chunk* c = g_chunks.get_opt(cpos + glm::ivec3(x, y, z));
+		if (c && !c->empty())
+		{
+			job->blocks[i] = c->blocks();
+			job->chunks[i] = &job->blocks[i];
+		}
+		else
+		{
+			job->chunks[i] = nullptr;
+		}
 	}
-	m_quads->push_back(q);
+	chunk.m_meshing = true;
+	g_mesher.submit(job);
 }
 
 const float foglimit2 = sqr(0.8 * RenderDistance * ChunkSize);
 
 void render_world_blocks(const glm::mat4& matrix, const Frustum& frustum)
 {
-	glUseProgram(block_program);
-	glUniformMatrix4fv(block_matrix_loc, 1, GL_FALSE, glm::value_ptr(matrix));
-	glUniform3fv(block_eye_loc, 1, glm::value_ptr(g_player.position));
 	if (!g_player.creative_mode) g_tick += 1;
-	glUniform1i(block_tick_loc, g_tick);
-	glUniform1f(block_foglimit2_loc, foglimit2);
-
-	glBindBuffer(GL_ARRAY_BUFFER, block_buffer);
-	glEnableVertexAttribArray(block_pos0_loc);
-	glEnableVertexAttribArray(block_pos1_loc);
-	glEnableVertexAttribArray(block_pos2_loc);
-	glEnableVertexAttribArray(block_pos3_loc);
-	glEnableVertexAttribArray(block_texture_loc);
-	glEnableVertexAttribArray(block_light_loc);
-	glEnableVertexAttribArray(block_plane_loc);
-
-	glVertexAttribIPointer(block_pos0_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[0]);
-	glVertexAttribIPointer(block_pos1_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[1]);
-	glVertexAttribIPointer(block_pos2_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[2]);
-	glVertexAttribIPointer(block_pos3_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[3]);
-	glVertexAttribIPointer(block_texture_loc, 1, GL_UNSIGNED_SHORT, sizeof(Quad), &((Quad*)0)->texture);
-	glVertexAttribIPointer(block_light_loc,   1, GL_UNSIGNED_SHORT, sizeof(Quad), &((Quad*)0)->light);
-	glVertexAttribIPointer(block_plane_loc,   1, GL_UNSIGNED_SHORT, sizeof(Quad), &((Quad*)0)->plane);
+	// before binding, as it can move the arena to another buffer
+	swap_meshes();
+
+	if (g_vertex_pulling)
+	{
+		glUseProgram(block_pull_program);
+		glUniformMatrix4fv(block_pull_matrix_loc, 1, GL_FALSE, glm::value_ptr(matrix));
+		glUniform3fv(block_pull_eye_loc, 1, glm::value_ptr(g_player.position));
+		glUniform1i(block_pull_tick_loc, g_tick);
+		glUniform1f(block_pull_foglimit2_loc, foglimit2);
+
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_BUFFER, block_quads_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, g_packed_arena.buffer());
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_BUFFER, block_pages_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, g_packed_arena.page_buffer());
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_BUFFER, block_origins_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, g_origin_buffer);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	else
+	{
+		glUseProgram(block_program);
+		glUniformMatrix4fv(block_matrix_loc, 1, GL_FALSE, glm::value_ptr(matrix));
+		glUniform3fv(block_eye_loc, 1, glm::value_ptr(g_player.position));
+		glUniform1i(block_tick_loc, g_tick);
+		glUniform1f(block_foglimit2_loc, foglimit2);
+
+		glBindBuffer(GL_ARRAY_BUFFER, g_block_arena.buffer());
+		glEnableVertexAttribArray(block_pos0_loc);
+		glEnableVertexAttribArray(block_pos1_loc);
+		glEnableVertexAttribArray(block_pos2_loc);
+		glEnableVertexAttribArray(block_pos3_loc);
+		glEnableVertexAttribArray(block_texture_loc);
+		glEnableVertexAttribArray(block_light_loc);
+		glEnableVertexAttribArray(block_plane_loc);
+
+		glVertexAttribIPointer(block_pos0_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[0]);
+		glVertexAttribIPointer(block_pos1_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[1]);
+		glVertexAttribIPointer(block_pos2_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[2]);
+		glVertexAttribIPointer(block_pos3_loc,    3, GL_UNSIGNED_BYTE,  sizeof(Quad), &((Quad*)0)->pos[3]);
+		glVertexAttribIPointer(block_texture_loc, 1, GL_UNSIGNED_SHORT, sizeof(Quad), &((Quad*)0)->texture);
+		glVertexAttribIPointer(block_light_loc,   1, GL_UNSIGNED_SHORT, sizeof(Quad), &((Quad*)0)->light);
+		glVertexAttribIPointer(block_plane_loc,   1, GL_UNSIGNED_SHORT, sizeof(Quad), &((Quad*)0)->plane);
+	}
 
 	stats::chunk_count = 0;
 	stats::quad_count = 0;
 
+	// visible chunks are from far to near
+	static std::vector<VisibleChunks::Element> remesh;
+	remesh.clear();
+	// with vertex pulling all chunks are drawn in two glMultiDrawArrays calls: opaque and blended
+	static std::vector<GLint> opaque_first, blended_first;
+	static std::vector<GLsizei> opaque_count, blended_count;
+	opaque_first.clear();
+	opaque_count.clear();
+	blended_first.clear();
+	blended_count.clear();
+
 	glEnable(GL_BLEND);
-	static BlockRenderer renderer;
 	for (VisibleChunks::Element e : visible_chunks)
 	{
 		glm::ivec3 cpos = e.cpos;
@@ -2231,25 +2180,38 @@ void render_world_blocks(const glm::mat4& matrix, const Frustum& frustum)
 			Chunk& chunk = g_chunks.get(cpos);
 			if (chunk.get_cpos() != cpos) continue;
 
-			if (chunk.m_remesh)
+			int lod = select_lod(sqrtf(e.distance), chunk.lod());
+			if (lod != chunk.lod()) chunk.set_lod(lod);
+			if (chunk.needs_remesh() && !chunk.m_meshing) remesh.push_back(e);
+			if (e.distance < SortDistance * SortDistance) chunk.sort(g_player.position);
+			if (g_vertex_pulling)
 			{
-				const Blocks* chunks[27];
-				FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1)
-				{
-					Chunk* c = g_chunks.get_opt(cpos + glm::ivec3(x, y, z));
-					chunks[x*9 + y*3 + z + 13] = c ? &c->blocks() : nullptr;
-				}
-				chunk.remesh(renderer, chunks);
+				stats::quad_count += chunk.batch(false, opaque_first, opaque_count);
+				stats::quad_count += chunk.batch(true, blended_first, blended_count);
+			}
+			else
+			{
+				glm::ivec3 pos = cpos * ChunkSize;
+				glUniform3iv(block_pos_loc, 1, glm::value_ptr(pos));
+				stats::quad_count += chunk.render();
 			}
-			glm::ivec3 pos = cpos * ChunkSize;
-			glUniform3iv(block_pos_loc, 1, glm::value_ptr(pos));
-			// TODO: avoid expensive sorting for far chunks
-			chunk.sort(g_player.position);
-			stats::quad_count += chunk.render();
 			stats::chunk_count += 1;
 		}
 	}
+	if (g_vertex_pulling)
+	{
+		// opaque near to far (for early depth test), then blended far to near
+		std::reverse(opaque_first.begin(), opaque_first.end());
+		std::reverse(opaque_count.begin(), opaque_count.end());
+		if (opaque_first.size() > 0) glMultiDrawArrays(GL_TRIANGLES, opaque_first.data(), opaque_count.data(), opaque_first.size());
+		if (blended_first.size() > 0) glMultiDrawArrays(GL_TRIANGLES, blended_first.data(), blended_count.data(), blended_first.size());
+	}
 	glDisable(GL_BLEND);
+
+	for (int i = remesh.size() - 1; i >= 0 && g_mesher.jobs() < MaxMeshJobs; i--)
+	{
+		submit_mesh_job(g_chunks.get(remesh[i].cpos), remesh[i].distance);
+	}
 }
 
 struct Avatar
@@ -2378,6 +2340,34 @@ MessageServerStatus g_server_status;
 uint32_t g_bytes_received;
 uint32_t g_server_frames = 0;
 
+// bounding box of blocks which differ, returns false if there are none
+bool changed_box(const Block* a, const Block* b, glm::ivec3& lo, glm::ivec3& hi)
+{
+	if (memcmp(a, b, sizeof(Block) * ChunkSize3) == 0) return false;
+	lo = glm::ivec3(ChunkSize);
+	hi = glm::ivec3(-1);
+	FOR(i, ChunkSize3) if (a[i] != b[i])
+	{
+		glm::ivec3 p = block_position(i);
+		lo = glm::min(lo, p);
+		hi = glm::max(hi, p);
+	}
+	return true;
+}
+
+// remesh only planes of chunk and its neighbors which depend on blocks in box [lo, hi] of chunk at cpos
+void mark_remesh_around(glm::ivec3 cpos, glm::ivec3 lo, glm::ivec3 hi)
+{
+	FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1)
+	{
+		glm::ivec3 d(x, y, z);
+		Chunk* c = g_chunks.get_opt(cpos + d);
+		if (!c) continue;
+		DirtyPlanes planes = DirtyPlanes::around(lo - d * ChunkSize, hi - d * ChunkSize);
+		if (!planes.empty()) c->mark_remesh(planes);
+	}
+}
+
 bool client_receive_message()
 {
 	SocketBuffer& recv = g_recv_buffer;
@@ -2407,11 +2397,31 @@ bool client_receive_message()
 		auto message = recv.read<MessageChunkState>();
 		if (!message) return false;
 		Chunk& chunk = g_chunks.get(message->cpos);
-		chunk.init(message->cpos, message->blocks);
-		FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1)
+		// new chunk can differ anywhere from what neighbors were meshed with
+		glm::ivec3 lo(0, 0, 0), hi(ChunkSize - 1, ChunkSize - 1, ChunkSize - 1);
+		if (chunk.get_cpos() == message->cpos)
+		{
+			if (!changed_box(chunk.blocks().data(), message->blocks, lo, hi)) return true;
+			chunk.update(message->blocks);
+		}
+		else
+		{
+			chunk.init(message->cpos, message->blocks);
+		}
+		mark_remesh_around(message->cpos, lo, hi);
+		return true;
+	}
+	case MessageType::BlockUpdates:
+	{
+		auto message = read_block_updates(recv);
+		if (!message) return false;
+		Chunk* chunk = g_chunks.get_opt(message->cpos);
+		if (!chunk) return true;
+		chunk->update(message->updates, message->count);
+		FOR(i, message->count)
 		{
-			Chunk* c = g_chunks.get_opt(message->cpos + glm::ivec3(x, y, z));
-			if (c) c->m_remesh = true; // TODO optimize this
+			glm::ivec3 p = block_position(message->updates[i].index);
+			mark_remesh_around(message->cpos, p, p);
 		}
 		return true;
 	}
@@ -2453,18 +2463,20 @@ void render_gui()
 	if (show_counters && !console.IsVisible())
 	{
 		text->Reset(width, height, matrix, true);
-		int raytrace = std::round(100.0f * (directions.size() - rays_remaining) / directions.size());
-		text->Print("[%.1f %.1f %.1f] C:%4d Q:%3dk frame:%2.0f model:%1.0f raytrace:%2.0f %d%% render %2.0f F%c%c%c recv:%u send:%u",
+		text->Print("[%.1f %.1f %.1f] C:%4d Q:%3dk frame:%2.0f model:%1.0f visibility:%2.1f render %2.0f F%c%c%c recv:%u send:%u gpu:%u/%uMB",
 			g_player.position.x, g_player.position.y, g_player.position.z, stats::chunk_count, stats::quad_count / 1000,
-			stats::frame_time_ms, stats::model_time_ms, stats::raytrace_time_ms, raytrace, stats::render_time_ms,
-			enable_f4 ? '4' : '-', enable_f5 ? '5' : '-', enable_f6 ? '6' : '-', g_recv_buffer.size(), g_send_buffer.size());
+			stats::frame_time_ms, stats::model_time_ms, stats::visibility_time_ms, stats::render_time_ms,
+			enable_f4 ? '4' : '-', enable_f5 ? '5' : '-', enable_f6 ? '6' : '-', g_recv_buffer.size(), g_send_buffer.size(),
+			block_arena().used_bytes() >> 20, block_arena().capacity_bytes() >> 20);
 
-		text->Print("collide:%1.0f select:%1.0f simulate:%1.0f [%.1f %.1f %.1f] %.1f%s",
+		text->Print("collide:%1.0f select:%1.0f simulate:%1.0f [%.1f %.1f %.1f] %.1f%s mesh cache:%u/%u %zuMB",
 			stats::collide_time_ms, stats::select_time_ms, stats::simulate_time_ms,
-			g_player.velocity.x, g_player.velocity.y, g_player.velocity.z, glm::length(g_player.velocity), on_the_ground ? " ground" : "");
+			g_player.velocity.x, g_player.velocity.y, g_player.velocity.z, glm::length(g_player.velocity), on_the_ground ? " ground" : "",
+			g_mesh_cache.hits(), g_mesh_cache.hits() + g_mesh_cache.misses(), g_mesh_cache.bytes() >> 20);
 
-		text->Print("exchange:%u inbox:%u simulation:%u chunk:%u avatar:%u received:%ukb frame:%u",
-			g_server_status.exchange_time, g_server_status.inbox_time, g_server_status.simulation_time, g_server_status.chunk_time, g_server_status.avatar_time, g_bytes_received / 1024, g_server_frames);
+		text->Print("exchange:%u inbox:%u simulation:%u backlog:%u chunk:%u avatar:%u received:%ukb frame:%u",
+			g_server_status.exchange_time, g_server_status.inbox_time, g_server_status.simulation_time, g_server_status.simulation_backlog,
+			g_server_status.chunk_time, g_server_status.avatar_time, g_bytes_received / 1024, g_server_frames);
 
 		if (selection)
 		{
@@ -2601,8 +2613,6 @@ void OnError(int error, const char* message)
 	fprintf(stderr, "GLFW error %d: %s\n", error, message);
 }
 
-double Timestamp::milisec_per_tick = 0;
-
 std::atomic<Timestamp> stall_ts;
 std::atomic<bool> stall_enable(true);
 
@@ -2655,6 +2665,7 @@ void command_import(char* filename, glm::ivec3 pos, float scale)
 void command_set()
 {
 	console.Print("collision = %s\n", g_collision ? "true" : "false");
+	FOR(i, MaxLod) console.Print("lod%d = %d\n", i + 1, lod_distance[i].load(std::memory_order_relaxed));
 }
 
 void command_set(Token key, Token value)
@@ -2666,6 +2677,17 @@ void command_set(Token key, Token value)
 		console.Print("error in syntax: set collision (true | false)\n");
 		return;
 	}
+	FOR(i, MaxLod)
+	{
+		char name[8];
+		snprintf(name, sizeof(name), "lod%d", i + 1);
+		if (key == name)
+		{
+			if (is_integer(value)) { lod_distance[i].store(parse_int(value), std::memory_order_relaxed); return; }
+			console.Print("error in syntax: set %s <distance in chunks>\n", name);
+			return;
+		}
+	}
 	console.Print("unknown var %.*s. type 'set' for list of all vars.", key.second, key.first);
 }
 
@@ -2728,6 +2750,7 @@ GLFWwindow* create_window()
 
 bool g_run_server = true;
 const char* g_connect_to = "localhost";
+const char* g_record_path = nullptr;
 
 bool parse_command_args(int argc, char** argv)
 {
@@ -2750,6 +2773,16 @@ bool parse_command_args(int argc, char** argv)
 			g_connect_to = argv[i+1];
 			i += 1;
 		}
+		else if (strcmp("--record", argv[i]) == 0)
+		{
+			if (i+1 >= argc) return false;
+			g_record_path = argv[i+1];
+			i += 1;
+		}
+		else if (strcmp("--geometry-shader", argv[i]) == 0)
+		{
+			g_vertex_pulling = false;
+		}
 		else
 		{
 			return false;
@@ -2768,7 +2801,7 @@ int main(int argc, char** argv)
 
 	if (!parse_command_args(argc, argv))
 	{
-		printf("usage: %s [--server | --join <hostname>]\n", argv[0]);
+		printf("usage: %s [--server | --join <hostname>] [--record <file>] [--geometry-shader]\n", argv[0]);
 		return 0;
 	}
 
@@ -2776,10 +2809,11 @@ int main(int argc, char** argv)
 
 	if (!g_connect_to)
 	{
-		server_main();
+		Timestamp::calibrate();
+		server_main(g_record_path);
 		return 0;
 	}
-	if (g_run_server) std::thread(server_main).detach();
+	if (g_run_server) std::thread(server_main, g_record_path).detach();
 
 	fprintf(stderr, "Connecting to %s:7000 ...\n", g_connect_to);
 	int retries = 0;
@@ -2808,6 +2842,7 @@ int main(int argc, char** argv)
 	CHECK(window);
 	model_init(window);
 	render_init();
+	g_mesher.start(std::max(1, int(std::thread::hardware_concurrency()) - 2)); // main thread and server
 
 	glm::dvec3 c;
 	glm::i64vec3 d;
@@ -2865,7 +2900,7 @@ int main(int argc, char** argv)
 			Timestamp td;
 			stats::frame_time_ms = glm::mix<float>(stats::frame_time_ms, frame_ms, 0.15f);
 			stats::model_time_ms = glm::mix<float>(stats::model_time_ms, ta.elapsed_ms(tb), 0.15f);
-			stats::raytrace_time_ms = glm::mix<float>(stats::raytrace_time_ms, tb.elapsed_ms(tc), 0.15f);
+			stats::visibility_time_ms = glm::mix<float>(stats::visibility_time_ms, tb.elapsed_ms(tc), 0.15f);
 			stats::render_time_ms = glm::mix<float>(stats::render_time_ms, tc.elapsed_ms(td), 0.15f);
 		}
 
@@ -0,0 +1,120 @@
+#include "util.hh"
+#include "block.hh"
+#include "algorithm.hh"
+#include <unordered_map>
+
+// Compares SpatialMap with std::unordered_map<glm::ivec3> on access patterns of the server.
+
+template<typename Map>
+int64_t find_all(Map& map, const std::vector<glm::ivec3>& keys, int rounds);
+
+template<>
+int64_t find_all(std::unordered_map<glm::ivec3, int>& map, const std::vector<glm::ivec3>& keys, int rounds)
+{
+	int64_t sum = 0;
+	FOR(r, rounds) for (glm::ivec3 a : keys)
+	{
+		auto it = map.find(a);
+		if (it != map.end()) sum += it->second;
+	}
+	return sum;
+}
+
+template<>
+int64_t find_all(SpatialMap<int>& map, const std::vector<glm::ivec3>& keys, int rounds)
+{
+	int64_t sum = 0;
+	FOR(r, rounds) for (glm::ivec3 a : keys)
+	{
+		int* e = map.find(a);
+		if (e) sum += *e;
+	}
+	return sum;
+}
+
+template<typename Map>
+void fill(Map& map, int n)
+{
+	FOR(x, n) FOR(y, n) FOR(z, n) map[glm::ivec3(x, y, z) - n / 2] = x + y + z;
+}
+
+template<typename Map>
+double bench_find(const char* name, const std::vector<glm::ivec3>& keys, int n, int rounds)
+{
+	Map map;
+	fill(map, n);
+	Timestamp ta;
+	int64_t sum = find_all(map, keys, rounds);
+	double ns = ta.elapsed_ms() * 1e6 / (double(keys.size()) * rounds);
+	printf("  %-14s %7.2f ns/find (%lld)\n", name, ns, (long long)sum);
+	return ns;
+}
+
+double bench_churn_unordered(int n, int rounds)
+{
+	std::unordered_map<glm::ivec3, int> map;
+	Timestamp ta;
+	FOR(r, rounds)
+	{
+		FOR(x, n) FOR(y, n) FOR(z, n) map[glm::ivec3(x + r, y, z)] = r;
+		FOR(x, n) FOR(y, n) FOR(z, n) map.erase(glm::ivec3(x + r, y, z));
+	}
+	return ta.elapsed_ms() * 1e6 / (2.0 * n * n * n * rounds);
+}
+
+double bench_churn_spatial(int n, int rounds)
+{
+	SpatialMap<int> map;
+	Timestamp ta;
+	FOR(r, rounds)
+	{
+		FOR(x, n) FOR(y, n) FOR(z, n) map[glm::ivec3(x + r, y, z)] = r;
+		FOR(x, n) FOR(y, n) FOR(z, n) map.erase(glm::ivec3(x + r, y, z));
+	}
+	return ta.elapsed_ms() * 1e6 / (2.0 * n * n * n * rounds);
+}
+
+double bench_bitset(int rounds)
+{
+	// flood of neighboring blocks, as in model_simulate_gravity()
+	BitSet<ChunkSizeBits> set;
+	Sphere sphere(40);
+	Timestamp ta;
+	uint64_t c = 0;
+	FOR(r, rounds)
+	{
+		set.clear();
+		for (glm::ivec3 d : sphere) c += set.xset(d);
+	}
+	double ns = ta.elapsed_ms() * 1e6 / (double(sphere.size()) * rounds);
+	printf("  %-14s %7.2f ns/xset (%llu)\n", "BitSet", ns, (unsigned long long)c);
+	return ns;
+}
+
+int main(int argc, char** argv)
+{
+	Timestamp::calibrate();
+	const int n = 16;
+
+	// random keys, half of them missing
+	std::vector<glm::ivec3> random_keys;
+	FOR(i, 1 << 20) random_keys.push_back(glm::ivec3(rand() % (2 * n), rand() % (2 * n), rand() % (2 * n)) - n);
+	printf("random find:\n");
+	bench_find<std::unordered_map<glm::ivec3, int>>("unordered_map", random_keys, n, 4);
+	bench_find<SpatialMap<int>>("SpatialMap", random_keys, n, 4);
+
+	// chunks of a sphere mapped to superchunks, as in schedule_active_chunks()
+	std::vector<glm::ivec3> sphere_keys;
+	for (glm::ivec3 d : Sphere(40)) sphere_keys.push_back(d >> SuperChunkSizeBits);
+	printf("sphere find (repeated keys):\n");
+	bench_find<std::unordered_map<glm::ivec3, int>>("unordered_map", sphere_keys, n, 4);
+	bench_find<SpatialMap<int>>("SpatialMap", sphere_keys, n, 4);
+
+	printf("insert + erase:\n");
+	printf("  %-14s %7.2f ns/op\n", "unordered_map", bench_churn_unordered(16, 64));
+	printf("  %-14s %7.2f ns/op\n", "SpatialMap", bench_churn_spatial(16, 64));
+
+	printf("bitset:\n");
+	bench_bitset(20);
+	return 0;
+}
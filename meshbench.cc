@@ -0,0 +1,107 @@
+#include "util.hh"
+#include "block.hh"
+#include "algorithm.hh"
+#include "mesher.hh"
+
+// Measures BlockRenderer::generate_quads (with and without merging) on generated terrain, without GL window.
+
+void generate_chunk(Blocks& chunk, glm::ivec3 cpos);
+
+// 4x4x3 chunks at each of the interesting places
+std::vector<glm::ivec3> bench_positions()
+{
+	const glm::ivec3 places[] = {
+		glm::ivec3(-25, -25, 0), // crater
+		glm::ivec3(25, 25, 1), // moon
+		glm::ivec3(0, 0, 0), // showcase
+		glm::ivec3(60, -80, 0), // forest
+		glm::ivec3(-70, 40, 7), // clouds
+		glm::ivec3(10, 10, -1), // underground
+		glm::ivec3(5, -2, 0), // water
+	};
+	std::vector<glm::ivec3> list;
+	for (glm::ivec3 c : places) FOR(x, 4) FOR(y, 4) FOR(z, 3) list.push_back(c + glm::ivec3(x, y, z - 1));
+	return list;
+}
+
+struct Result
+{
+	double chunks_per_sec;
+	size_t quads, blended;
+};
+
+Result mesh_all(const std::vector<glm::ivec3>& list, SpatialMap<Blocks*>& map, bool merge, int rounds)
+{
+	BlockRenderer renderer;
+	std::vector<Quad> quads;
+	Result result = { 0, 0, 0 };
+	FOR(r, rounds)
+	{
+		Timestamp ta;
+		size_t total = 0, blended_total = 0;
+		for (glm::ivec3 c : list)
+		{
+			const Blocks* chunks[27];
+			FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1) chunks[x * 9 + y * 3 + z + 13] = *map.find(c + glm::ivec3(x, y, z));
+			int blended;
+			renderer.generate_quads(c, chunks, merge, quads, blended);
+			total += quads.size();
+			blended_total += blended;
+		}
+		result.chunks_per_sec = std::max(result.chunks_per_sec, list.size() / (ta.elapsed_ms() / 1000));
+		result.quads = total;
+		result.blended = blended_total;
+	}
+	return result;
+}
+
+// Empty chunk which gets a block has to be meshed, but its connectivity stays the same (so client can't rely on
+// it to notice the chunk, see Chunk::update_empty in main.cc).
+bool check_empty_chunk()
+{
+	Blocks empty, one;
+	empty.clear(Block::none);
+	one.clear(Block::none);
+	one[glm::ivec3(5, 6, 7)] = Block::dirt;
+	const Blocks* chunks[27] = {};
+	chunks[13] = &one;
+
+	BlockRenderer renderer;
+	std::vector<Quad> quads;
+	int blended;
+	renderer.generate_quads(glm::ivec3(0, 0, 0), chunks, true, quads, blended);
+	if (quads.size() != 6 || face_connectivity(one) != face_connectivity(empty) || face_connectivity(empty) != AllFacesConnected)
+	{
+		printf("FAIL: block in empty chunk gives %zu quads (expected 6), connectivity %llx\n", quads.size(), (unsigned long long)face_connectivity(one));
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	int rounds = (argc > 1) ? atoi(argv[1]) : 5;
+	Timestamp::calibrate();
+
+	std::vector<glm::ivec3> list = bench_positions();
+	SpatialMap<Blocks*> map;
+	for (glm::ivec3 c : list) FOR2(x, -1, 1) FOR2(y, -1, 1) FOR2(z, -1, 1)
+	{
+		glm::ivec3 p = c + glm::ivec3(x, y, z);
+		if (map.find(p)) continue;
+		Blocks* b = new Blocks;
+		generate_chunk(*b, p);
+		map[p] = b;
+	}
+
+	if (!check_empty_chunk()) return 1;
+
+	printf("%zu chunks, best of %d rounds\n", list.size(), rounds);
+	for (bool merge : { true, false })
+	{
+		Result r = mesh_all(list, map, merge, rounds);
+		printf("  %-8s %8.0f chunks/s %7.1f quads/chunk %6.1f blended/chunk\n", merge ? "merge" : "no merge",
+			r.chunks_per_sec, double(r.quads) / list.size(), double(r.blended) / list.size());
+	}
+	return 0;
+}
@@ -0,0 +1,824 @@
+#include "mesher.hh"
+#include "auto.hh"
+#include "city.h"
+#include <emmintrin.h>
+
+namespace Cube
+{
+	glm::ivec3 corner[8];
+	const int faces[6][4] = { { 0, 4, 6, 2 }/*xmin*/, { 1, 3, 7, 5 }/*xmax*/, { 0, 1, 5, 4 }/*ymin*/, { 2, 6, 7, 3 }/*ymax*/, { 0, 2, 3, 1 }/*zmin*/, { 4, 5, 7, 6 }/*zmax*/ };
+	glm::i8vec3 lightmap[6/*face*/][8/*vertex*/][4/*four blocks around vertex affecting light of vertex*/];
+	glm::i8vec3 lightmap2[6/*face*/][8/*vertex*/][4*3/*three blocks around four blocks around vertex affecting light of vertex*/];
+
+	Initialize
+	{
+		FOR(i, 8)
+		{
+			FOR(i, 8) corner[i] = glm::ivec3(i&1, (i>>1)&1, (i>>2)&1);
+			FOR(f, 6)
+			{
+				glm::ivec3 max = corner[i], min = max - ii;
+				if (f % 2 == 0) max[f / 2] -= 1;
+				if (f % 2 == 1) min[f / 2] += 1;
+				int p = 0;
+				int q = 0;
+				FOR2(x, min.x, max.x) FOR2(y, min.y, max.y) FOR2(z, min.z, max.z)
+				{
+					lightmap[f][i][p++] = glm::i8vec3(x, y, z);
+					FOR(ff, 6) if (ff != (f ^ 1))
+					{
+						glm::ivec3 b = glm::ivec3(x, y, z) + face_dir[ff];
+						if (!between(min, b, max)) lightmap2[f][i][q++] = glm::i8vec3(b);
+					}
+					assert(q == p * 3);
+				}
+			}
+		}
+	}
+}
+
+// relative to chunk, in blocks
+glm::vec3 centroid(const Quad& q)
+{
+	glm::vec3 a(q.pos[0]), c(q.pos[2]);
+	return (a + c) * (0.5f / 15);
+}
+
+bool operator<(const Quad& a, const Quad& b)
+{
+	if (a.texture != b.texture)
+	{
+		int ga = is_blended(a.texture) ? 1 : 0;
+		int gb = is_blended(b.texture) ? 1 : 0;
+		if (ga != gb) return ga < gb;
+		return a.texture < b.texture;
+	}
+	if (a.plane != b.plane) return a.plane < b.plane;
+	return a.light < b.light;
+}
+
+uint8_t Light(const Quad& q, int i)
+{
+	int s = (i % 4) * 2;
+	int a = (q.light >> s) & 3;
+	return (a + 1) * 64 - 1;
+}
+
+uint8_t Light2(const Quad& q, int i)
+{
+	int s = (i % 4) * 4;
+	int a = (q.light >> s) & 15;
+	return (a + 1) * 16 - 1;
+}
+
+Block BlockRenderer::get(glm::ivec3 rel)
+{
+	glm::ivec3 a = m_pos + rel + 2;
+	assert(0 <= a.x && a.x < Padded);
+	assert(0 <= a.y && a.y < Padded);
+	assert(0 <= a.z && a.z < Padded);
+	return m_padded[a.z][a.y][a.x];
+}
+
+void BlockRenderer::build_padded()
+{
+	static const Block none[ChunkSize] = {};
+	FOR2(z, -2, ChunkSize + 1) FOR2(y, -2, ChunkSize + 1)
+	{
+		int dz = (z < 0) ? -1 : (z >= ChunkSize) ? 1 : 0;
+		int dy = (y < 0) ? -1 : (y >= ChunkSize) ? 1 : 0;
+		int offset = ((z & ChunkSizeMask) * ChunkSize + (y & ChunkSizeMask)) * ChunkSize;
+		Block* row = m_padded[z + 2][y + 2];
+		FOR2(dx, -1, 1)
+		{
+			const Blocks* c = m_chunks[dx * 9 + dy * 3 + dz + 13];
+			const Block* src = c ? c->data() + offset : none;
+			if (dx == -1) memcpy(row, src + ChunkSize - 2, 2 * sizeof(Block));
+			if (dx == 0) memcpy(row + 2, src, ChunkSize * sizeof(Block));
+			if (dx == 1) memcpy(row + 2 + ChunkSize, src, 2 * sizeof(Block));
+		}
+	}
+
+	static_assert(sizeof(Block) == 1 && sizeof(m_padded) % 16 == 0, "");
+	const __m128i one = _mm_set1_epi8(1), glass = _mm_set1_epi8(char(Block::glass_white));
+	for (size_t i = 0; i < sizeof(m_padded); i += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&m_padded[0][0][0] + i));
+		__m128i see = _mm_cmpeq_epi8(_mm_min_epu8(v, glass), v);
+		__m128i none = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+		__m128i w = _mm_add_epi8(_mm_and_si128(see, one), _mm_and_si128(none, one));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&m_weight[0][0][0] + i), w);
+	}
+}
+
+uint64_t BlockRenderer::neighborhood_hash(const Blocks* chunks[27])
+{
+	m_chunks = chunks;
+	build_padded();
+	m_padded_ready = true;
+	return CityHash64(reinterpret_cast<const char*>(m_padded), sizeof(m_padded));
+}
+
+void BlockRenderer::row_light(int face, int y, int z, uint16_t light[ChunkSize])
+{
+	static_assert(ChunkSize == 16, "");
+	const uint8_t* base = &m_weight[z + 2][y + 2][2];
+	auto load = [base](glm::i8vec3 d) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + (d.z * Padded + d.y) * Padded + d.x)); };
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = zero, hi = zero;
+	const int* f = Cube::faces[face];
+	FOR(i, 4)
+	{
+		glm::i8vec3* map = Cube::lightmap[face][f[i]];
+		glm::i8vec3* map2 = Cube::lightmap2[face][f[i]];
+		__m128i s = zero;
+		FOR(j, 4)
+		{
+			// far blocks only count if near block is see-through
+			__m128i n = load(map[j]);
+			__m128i w = _mm_add_epi8(n, _mm_add_epi8(load(map2[j*3]), _mm_add_epi8(load(map2[j*3+1]), load(map2[j*3+2]))));
+			s = _mm_add_epi8(s, _mm_and_si128(w, _mm_cmpgt_epi8(n, zero)));
+		}
+		// (s / 2 - 1) << (i * 4), in 16 bits (like int in face_light2, s / 2 == 0 sets all higher vertices)
+		const __m128i ones = _mm_set1_epi16(1), shift = _mm_cvtsi32_si128(i * 4);
+		__m128i sl = _mm_srli_epi16(_mm_unpacklo_epi8(s, zero), 1);
+		__m128i sh = _mm_srli_epi16(_mm_unpackhi_epi8(s, zero), 1);
+		lo = _mm_or_si128(lo, _mm_sll_epi16(_mm_sub_epi16(sl, ones), shift));
+		hi = _mm_or_si128(hi, _mm_sll_epi16(_mm_sub_epi16(sh, ones), shift));
+	}
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(light), lo);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(light + 8), hi);
+}
+
+uint8_t BlockRenderer::face_light(int face)
+{
+	const int* f = Cube::faces[face];
+	int q = 0;
+	FOR(i, 4)
+	{
+		glm::i8vec3* map = Cube::lightmap[face][f[i]];
+		int s = 0;
+		FOR(j, 4) if (get(glm::ivec3(map[j])) == Block::none) s += 1;
+		q |= (s - 1) << (i * 2);
+	}
+	return q;
+}
+
+uint16_t BlockRenderer::face_light2(int face)
+{
+	const int* f = Cube::faces[face];
+	int q = 0;
+	FOR(i, 4)
+	{
+		glm::i8vec3* map = Cube::lightmap[face][f[i]];
+		glm::i8vec3* map2 = Cube::lightmap2[face][f[i]];
+		int s = 0;
+		FOR(j, 4)
+		{
+			Block b = get(glm::ivec3(map[j]));
+			if (can_see_through(b))
+			{
+				s += (b == Block::none) ? 2 : 1;
+				FOR(k, 3)
+				{
+					Block b2 = get(glm::ivec3(map2[j*3+k]));
+					if (can_see_through(b2)) s += (b2 == Block::none) ? 2 : 1;
+				}
+			}
+		}
+		s = s / 2;
+		q |= (s - 1) << (i * 4);
+	}
+	return q;
+}
+
+template<bool side>
+void BlockRenderer::draw_non_water_face(int face)
+{
+	Block q = get(face);
+	if (side && is_water(q))
+	{
+		if (q == Block::water)
+		{
+			draw_quad(face, false, true);
+		}
+		else if (q != m_block)
+		{
+			draw_quad(face, 0, water_level(q), false, true);
+			draw_quad(face, water_level(q), 15, false, false);
+		}
+		return;
+	}
+	if (!side && q == Block::water)
+	{
+		draw_quad(face, false, true);
+		return;
+	}
+	if (can_see_through(q) && q != m_block)
+	{
+		draw_quad(face, false, false);
+	}
+}
+
+void BlockRenderer::draw_water_side(int face, int w)
+{
+	Block q = get(face);
+	if (is_water_partial(q))
+	{
+		if (w > water_level(q))
+		{
+			draw_quad(face, water_level(q), w, false, false);
+			draw_quad(face, water_level(q), w, true, false);
+		}
+	}
+	else if (can_see_through_non_water(q))
+	{
+		draw_quad(face, 0, w, false, false);
+		draw_quad(face, 0, w, true, false);
+	}
+}
+
+void BlockRenderer::draw_water_bottom()
+{
+	Block q = get(/*m_pos.z != CMin, 4,*/ -iz);
+	if (q != Block::water && can_see_through(q)) draw_quad(4, false, false);
+	if (q == Block::none) draw_quad(4, true, false);
+}
+
+void BlockRenderer::draw_water_top(int w)
+{
+	if (m_block == Block::water)
+	{
+		Block q = get(/*m_pos.z != CMax, 5,*/ iz);
+		if (can_see_through_non_water(q)) draw_quad(5, false, false);
+		if (q == Block::none) draw_quad(5, true, false);
+	}
+	else
+	{
+		draw_quad(5, w, w, false, false);
+		draw_quad(5, w, w, true, false);
+	}
+}
+
+template<bool Transposed>
+int BlockRenderer::greedy(const Layer& layer, Rect* out)
+{
+	uint16_t rows[ChunkSize];
+	if (Transposed)
+	{
+		memset(rows, 0, sizeof(rows));
+		FOR(v, ChunkSize) for (uint32_t bits = layer.rows[v]; bits; bits &= bits - 1) rows[__builtin_ctz(bits)] |= 1u << v;
+	}
+	else
+	{
+		memcpy(rows, layer.rows, sizeof(rows));
+	}
+	auto key = [&layer](int a, int b) { return Transposed ? layer.keys[b][a] : layer.keys[a][b]; };
+
+	int count = 0;
+	FOR(a, ChunkSize) while (rows[a])
+	{
+		int b = __builtin_ctz(rows[a]);
+		uint32_t k = key(a, b);
+		int w = 1, h = 1;
+		while (b + w < ChunkSize && (rows[a] & (1u << (b + w))) && key(a, b + w) == k) w += 1;
+		uint16_t run = ((1u << w) - 1) << b;
+		while (a + h < ChunkSize && (rows[a + h] & run) == run)
+		{
+			bool same = true;
+			FOR(i, w) if (key(a + h, b + i) != k) { same = false; break; }
+			if (!same) break;
+			h += 1;
+		}
+		FOR(i, h) rows[a + i] &= ~run;
+
+		Rect& r = out[count++];
+		r.key = k;
+		if (Transposed) { r.u = a; r.v = b; r.w = h; r.h = w; } else { r.u = b; r.v = a; r.w = w; r.h = h; }
+	}
+	return count;
+}
+
+BlockRenderer::RowMasks BlockRenderer::row_masks(const Block* row)
+{
+	static_assert(sizeof(Block) == 1 && ChunkSize == 16, "");
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row));
+	auto le = [v](Block b) { return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(char(b))), v))); };
+	uint32_t none = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	RowMasks m;
+	m.solid = (~none & 0xFFFF) << 1;
+	m.water = (le(Block::water) & ~none) << 1;
+	m.full_water = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(char(Block::water))))) << 1;
+	m.see = le(Block::glass_white) << 1;
+	return m;
+}
+
+void BlockRenderer::add_block(RowMasks& m, int x, Block b)
+{
+	uint32_t bit = 1u << (x + 1);
+	if (b != Block::none) m.solid |= bit;
+	if (is_water(b)) m.water |= bit;
+	if (b == Block::water) m.full_water |= bit;
+	if (can_see_through(b)) m.see |= bit;
+}
+
+void BlockRenderer::build_row_masks()
+{
+	FOR2(z, -1, ChunkSize) FOR2(y, -1, ChunkSize)
+	{
+		const Block* row = m_padded[z + 2][y + 2];
+		RowMasks& m = m_rows[z + 1][y + 1];
+		m = row_masks(row + 2);
+		add_block(m, -1, row[1]);
+		add_block(m, ChunkSize, row[ChunkSize + 2]);
+	}
+}
+
+void BlockRenderer::draw_water_block(glm::ivec3 p)
+{
+	m_pos = p;
+	m_block = (*m_chunks[13])[p];
+	int w = uint(m_block) - uint(Block::water1) + 1;
+	draw_water_side(0, w);
+	draw_water_side(1, w);
+	draw_water_side(2, w);
+	draw_water_side(3, w);
+	draw_water_bottom();
+	draw_water_top(w);
+}
+
+void BlockRenderer::find_visible_faces()
+{
+	const Blocks& mc = *m_chunks[13];
+	FOR(z, ChunkSize) FOR(y, ChunkSize)
+	{
+		const RowMasks& c = m_rows[z + 1][y + 1];
+		uint32_t blocks = c.solid & ~c.water & (((1u << ChunkSize) - 1) << 1);
+		FOR(i, 6) m_visible[i][z][y] = 0;
+		if (c.water & (((1u << ChunkSize) - 1) << 1))
+		{
+			for (uint32_t bits = c.water & (((1u << ChunkSize) - 1) << 1); bits; bits &= bits - 1)
+			{
+				int x = __builtin_ctz(bits) - 1;
+				// quads of water block are on its own six planes
+				if ((m_dirty.axis[0] >> x & 3) || (m_dirty.axis[1] >> y & 3) || (m_dirty.axis[2] >> z & 3))
+				{
+					draw_water_block(glm::ivec3(x, y, z));
+				}
+			}
+		}
+		if (!blocks) continue;
+
+		FOR(face, 6)
+		{
+			RowMasks q;
+			switch (face)
+			{
+			case 0: q = c; q.solid <<= 1; q.water <<= 1; q.full_water <<= 1; q.see <<= 1; break;
+			case 1: q = c; q.solid >>= 1; q.water >>= 1; q.full_water >>= 1; q.see >>= 1; break;
+			case 2: q = m_rows[z + 1][y]; break;
+			case 3: q = m_rows[z + 1][y + 2]; break;
+			case 4: q = m_rows[z][y + 1]; break;
+			case 5: q = m_rows[z + 2][y + 1]; break;
+			}
+			uint32_t water = (face < 4) ? q.water : q.full_water;
+			for (uint32_t bits = blocks & water; bits; bits &= bits - 1)
+			{
+				m_pos = glm::ivec3(__builtin_ctz(bits) - 1, y, z);
+				m_block = mc[m_pos];
+				if (face < 4) draw_non_water_face<true>(face); else draw_non_water_face<false>(face);
+			}
+
+			uint32_t visible = blocks & q.see & ~water;
+			for (uint32_t bits = visible & c.see & q.solid; bits; bits &= bits - 1)
+			{
+				glm::ivec3 p(__builtin_ctz(bits) - 1, y, z);
+				m_pos = p;
+				if (get(face_dir[face]) == mc[p]) visible &= ~(1u << (p.x + 1));
+			}
+			m_visible[face][z][y] = visible >> 1;
+		}
+	}
+}
+
+void BlockRenderer::emit_quad(int face, glm::ivec3 lo, glm::ivec3 ext, uint32_t key)
+{
+	Quad q;
+	q.texture = BlockTexture(key & 0xFFFF);
+	q.light = key >> 16;
+	const int* f = Cube::faces[face];
+	FOR(i, 4) q.pos[i] = glm::u8vec3((lo + Cube::corner[f[i]] * ext) * 15);
+	q.plane = (face << 8) | q.pos[0][face / 2];
+	m_quads->push_back(q);
+}
+
+void BlockRenderer::mesh_visible_faces(bool merge, std::vector<Quad>& out)
+{
+	const Blocks& mc = *m_chunks[13];
+	FOR(face, 6)
+	{
+		int axis = face / 2;
+		// layer coordinates: u is bit, v is row
+		int U = (axis == 0) ? 1 : 0;
+		int V = (axis == 2) ? 1 : 2;
+
+		// layer l is on plane l + side
+		int side = Cube::corner[Cube::faces[face][0]][axis];
+		uint32_t dirty = m_dirty.axis[axis] >> side;
+
+		uint32_t layers = 0;
+		FOR(z, ChunkSize) FOR(y, ChunkSize)
+		{
+			uint32_t row = (axis == 0) ? dirty : (dirty >> ((axis == 1) ? y : z) & 1) ? ~0u : 0;
+			uint32_t visible = m_visible[face][z][y] & row;
+			if (!visible) continue;
+			uint16_t light[ChunkSize];
+			row_light(face, y, z, light);
+			for (uint32_t bits = visible; bits; bits &= bits - 1)
+			{
+				glm::ivec3 p(__builtin_ctz(bits), y, z);
+				m_pos = p;
+				m_block = mc[p];
+				BlockTexture texture = get_block_texture(m_block, face);
+				if (is_leaves(texture) || is_blended(texture))
+				{
+					draw_quad(face, false, false);
+					continue;
+				}
+				Layer& layer = m_layers[p[axis]];
+				if (!(layers & (1u << p[axis])))
+				{
+					layers |= 1u << p[axis];
+					memset(layer.rows, 0, sizeof(layer.rows));
+				}
+				layer.rows[p[V]] |= 1u << p[U];
+				layer.keys[p[V]][p[U]] = uint32_t(texture) | (uint32_t(light[p.x]) << 16);
+			}
+		}
+
+		m_quads = &out;
+		for (; layers; layers &= layers - 1)
+		{
+			int l = __builtin_ctz(layers);
+			emit_layer(face, l, m_layers[l], merge, 1);
+		}
+		m_quads = &m_quadsp;
+	}
+}
+
+void BlockRenderer::emit_layer(int face, int l, const Layer& layer, bool merge, int scale)
+{
+	int axis = face / 2;
+	int U = (axis == 0) ? 1 : 0;
+	int V = (axis == 2) ? 1 : 2;
+	glm::ivec3 lo, ext(scale, scale, scale);
+	lo[axis] = l * scale;
+	if (!merge)
+	{
+		FOR(v, ChunkSize) for (uint32_t bits = layer.rows[v]; bits; bits &= bits - 1)
+		{
+			lo[U] = __builtin_ctz(bits) * scale;
+			lo[V] = v * scale;
+			emit_quad(face, lo, ext, layer.keys[v][__builtin_ctz(bits)]);
+		}
+		return;
+	}
+
+	// like merge_quads, try both directions and keep fewer quads
+	int a = greedy<false>(layer, m_rects[0]);
+	int b = greedy<true>(layer, m_rects[1]);
+	const Rect* rects = m_rects[(a <= b) ? 0 : 1];
+	FOR(i, std::min(a, b))
+	{
+		const Rect& r = rects[i];
+		lo[U] = r.u * scale;
+		lo[V] = r.v * scale;
+		ext[U] = r.w * scale;
+		ext[V] = r.h * scale;
+		emit_quad(face, lo, ext, r.key);
+	}
+}
+
+Block BlockRenderer::majority(const Blocks* chunk, glm::ivec3 lo, int s)
+{
+	if (!chunk) return Block::none;
+	uint8_t count[256];
+	memset(count, 0, sizeof(count));
+	int solid = 0, best_count = 0;
+	Block best = Block::none, border = Block::none;
+	FOR(z, s) FOR(y, s) FOR(x, s)
+	{
+		glm::ivec3 p = lo + glm::ivec3(x, y, z);
+		Block b = (*chunk)[p];
+		if (b == Block::none) continue;
+		if (is_water(b)) b = Block::water;
+		if (border == Block::none && (glm::min(p.x, glm::min(p.y, p.z)) == 0 || glm::max(p.x, glm::max(p.y, p.z)) == ChunkSize - 1)) border = b;
+		solid += 1;
+		int c = ++count[uint(b)];
+		if (c > best_count || (c == best_count && b < best))
+		{
+			best = b;
+			best_count = c;
+		}
+	}
+	return (solid * 2 >= s * s * s) ? best : border;
+}
+
+void BlockRenderer::generate_lod_quads(const Blocks* chunks[27], int lod, std::vector<Quad>& out, int& blended_quads)
+{
+	assert(1 <= lod && lod <= 2);
+	int s = 1 << lod, n = ChunkSize >> lod;
+	// neighbors may be drawn at other level (or full detail), so they can't hide border faces (cells outside are none)
+	memset(m_cells, 0, sizeof(m_cells));
+	FOR(z, n) FOR(y, n) FOR(x, n) m_cells[z + 1][y + 1][x + 1] = majority(chunks[13], glm::ivec3(x, y, z) * s, s);
+
+	out.clear();
+	m_quads = &out;
+	Layer& layer = m_layers[0];
+	FOR(face, 6)
+	{
+		int axis = face / 2;
+		int U = (axis == 0) ? 1 : 0;
+		int V = (axis == 2) ? 1 : 2;
+		FOR(l, n)
+		{
+			memset(layer.rows, 0, sizeof(layer.rows));
+			bool empty = true;
+			FOR(v, n) FOR(u, n)
+			{
+				glm::ivec3 c;
+				c[axis] = l;
+				c[U] = u;
+				c[V] = v;
+				Block b = cell(c), q = cell(c + face_dir[face]);
+				if (b == Block::none || !can_see_through(q) || q == b) continue;
+				layer.rows[v] |= 1u << u;
+				layer.keys[v][u] = uint32_t(get_block_texture(b, face)) | 0xFFFF0000u;
+				empty = false;
+			}
+			if (!empty) emit_layer(face, l, layer, true, s);
+		}
+	}
+	std::partition(out.begin(), out.end(), [](const Quad& q) { return !is_blended(q.texture); });
+	blended_quads = count_blended(out);
+}
+
+void BlockRenderer::generate_quads(glm::ivec3 cpos, const Blocks* chunks[27], bool merge, std::vector<Quad>& out, int& blended_quads)
+{
+	out.clear();
+	append_quads(cpos, chunks, DirtyPlanes::all(), merge, out);
+	if (!merge) std::partition(out.begin(), out.end(), [](const Quad& q) { return !is_blended(q.texture); });
+	blended_quads = count_blended(out);
+}
+
+void BlockRenderer::regenerate_quads(glm::ivec3 cpos, const Blocks* chunks[27], const DirtyPlanes& dirty, const std::vector<Quad>& old, std::vector<Quad>& out, int& blended_quads)
+{
+	out.clear();
+	for (const Quad& q : old) if (!dirty.has(q)) out.push_back(q);
+	append_quads(cpos, chunks, dirty, true, out);
+	std::partition(out.begin(), out.end(), [](const Quad& q) { return !is_blended(q.texture); });
+	blended_quads = count_blended(out);
+}
+
+void BlockRenderer::append_quads(glm::ivec3 cpos, const Blocks* chunks[27], const DirtyPlanes& dirty, bool merge, std::vector<Quad>& out)
+{
+	m_quadsp.clear();
+	m_quads = &m_quadsp;
+	if (!m_padded_ready || m_chunks != chunks)
+	{
+		m_chunks = chunks;
+		build_padded();
+	}
+	m_padded_ready = false;
+	m_dirty = dirty;
+
+	build_row_masks();
+	find_visible_faces();
+	mesh_visible_faces(merge, out);
+
+	// faces next to water are not filtered by plane when found
+	if (!dirty.full())
+	{
+		m_quadsp.erase(std::remove_if(m_quadsp.begin(), m_quadsp.end(), [&dirty](const Quad& q) { return !dirty.has(q); }), m_quadsp.end());
+	}
+	if (merge)
+	{
+		merge_quads(out);
+	}
+	else
+	{
+		out.insert(out.end(), m_quadsp.begin(), m_quadsp.end());
+	}
+}
+
+int BlockRenderer::count_blended(const std::vector<Quad>& quads)
+{
+	size_t blended = 0;
+	while (blended < quads.size() && is_blended(quads[quads.size() - 1 - blended].texture)) blended += 1;
+	return blended;
+}
+
+bool BlockRenderer::combine(Quad& a, Quad b, int X, int Y)
+{
+	if (a.pos[0][X] == b.pos[0][X] && a.pos[2][X] == b.pos[2][X] && a.pos[2][Y] == b.pos[0][Y])
+	{
+		a.pos[2] = b.pos[2];
+		if (a.pos[1][Y] == b.pos[0][Y]) a.pos[1] = b.pos[1];
+		if (a.pos[3][Y] == b.pos[0][Y]) a.pos[3] = b.pos[3];
+		return true;
+	}
+	return false;
+}
+
+void BlockRenderer::merge_axis(std::vector<Quad>& quads, int X, int Y)
+{
+	std::sort(quads.begin(), quads.end(), [X, Y](Quad a, Quad b) { return a.pos[0][X] < b.pos[0][X] || (a.pos[0][X] == b.pos[0][X] && a.pos[0][Y] < b.pos[0][Y]); });
+	int w = 0;
+	for (Quad q : quads)
+	{
+		if (w == 0 || !combine(quads[w-1], q, X, Y)) quads[w++] = q;
+	}
+	quads.resize(w);
+}
+
+void BlockRenderer::merge_quads(std::vector<Quad>& out)
+{
+	std::sort(m_quadsp.begin(), m_quadsp.end());
+	auto a = m_quadsp.begin();
+	while (a != m_quadsp.end())
+	{
+		auto b = a + 1;
+		while (b != m_quadsp.end() && a->texture == b->texture && a->plane == b->plane && a->light == b->light) b += 1;
+
+		if (is_leaves(a->texture))
+		{
+			while (a < b) out.push_back(*a++);
+			continue;
+		}
+
+		m_xy.clear();
+		m_yx.clear();
+		while (a < b)
+		{
+			m_xy.push_back(*a);
+			m_yx.push_back(*a);
+			a += 1;
+		}
+
+		int axis = m_xy[0].plane >> 9;
+		int x = (axis == 0) ? 1 : 0;
+		int y = (axis == 2) ? 1 : 2;
+
+		merge_axis(m_xy, x, y);
+		merge_axis(m_xy, y, x);
+		merge_axis(m_yx, y, x);
+		merge_axis(m_yx, x, y);
+
+		if (m_xy.size() > m_yx.size()) std::swap(m_xy, m_yx);
+		for (Quad& q : m_xy)
+		{
+			out.push_back(q);
+		}
+	}
+}
+
+void BlockRenderer::draw_quad(int face, bool reverse, bool underwater_overlay)
+{
+	Quad q;
+	q.texture = get_block_texture(m_block, face);
+	if (underwater_overlay) q.texture = BlockTexture((int)q.texture | (1 << 15));
+	const int* f = Cube::faces[face];
+	q.light = face_light2(face); // TODO reverse?
+	glm::ivec3 w = m_pos & ChunkSizeMask;
+	if (reverse)
+	{
+		q.pos[0] = glm::u8vec3((w + Cube::corner[f[0]]) * 15);
+		q.pos[1] = glm::u8vec3((w + Cube::corner[f[3]]) * 15);
+		q.pos[2] = glm::u8vec3((w + Cube::corner[f[2]]) * 15);
+		q.pos[3] = glm::u8vec3((w + Cube::corner[f[1]]) * 15);
+		q.plane = ((face ^ 1) << 8) | q.pos[0][face / 2];
+	}
+	else
+	{
+		q.pos[0] = glm::u8vec3((w + Cube::corner[f[0]]) * 15);
+		q.pos[1] = glm::u8vec3((w + Cube::corner[f[1]]) * 15);
+		q.pos[2] = glm::u8vec3((w + Cube::corner[f[2]]) * 15);
+		q.pos[3] = glm::u8vec3((w + Cube::corner[f[3]]) * 15);
+		q.plane = (face << 8) | q.pos[0][face / 2];
+	}
+	m_quads->push_back(q);
+}
+
+static glm::ivec3 adjust(glm::ivec3 v, int zmin, int zmax)
+{
+	return glm::ivec3(v.x * 15, v.y * 15, (v.z == 0) ? zmin : zmax);
+}
+
+void BlockRenderer::draw_quad(int face, int zmin, int zmax, bool reverse, bool underwater_overlay)
+{
+	Quad q;
+	q.texture = get_block_texture(m_block, face);
+	if (underwater_overlay) q.texture = BlockTexture((int)q.texture | (1 << 15));
+	const int* f = Cube::faces[face];
+	q.light = face_light2(face); // TODO zmin/zmax? // TODO reverse?
+	glm::ivec3 w = m_pos & ChunkSizeMask;
+	if (reverse)
+	{
+		q.pos[0] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[0]], zmin, zmax));
+		q.pos[1] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[3]], zmin, zmax));
+		q.pos[2] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[2]], zmin, zmax));
+		q.pos[3] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[1]], zmin, zmax));
+		q.plane = ((face ^ 1) << 8) | q.pos[0][face / 2];
+	}
+	else
+	{
+		q.pos[0] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[0]], zmin, zmax));
+		q.pos[1] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[1]], zmin, zmax));
+		q.pos[2] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[2]], zmin, zmax));
+		q.pos[3] = glm::u8vec3(w * 15 + adjust(Cube::corner[f[3]], zmin, zmax));
+		q.plane = (face << 8) | q.pos[0][face / 2];
+	}
+	m_quads->push_back(q);
+}
+
+// bits of seed grown to whole runs of bits in mask
+static uint16_t fill_runs(uint32_t seed, uint32_t mask)
+{
+	uint32_t m = seed & mask;
+	while (true)
+	{
+		uint32_t n = (m | (m << 1) | (m >> 1)) & mask;
+		if (n == m) return m;
+		m = n;
+	}
+}
+
+// Flood fill of each component of see-through blocks (with rows of 16 blocks as bit masks), and all faces it
+// touches are connected to each other.
+uint64_t face_connectivity(const Blocks& blocks)
+{
+	static_assert(ChunkSize == 16, "");
+	uint16_t see[ChunkSize][ChunkSize]; // [z][y] bit x
+	uint16_t left[ChunkSize][ChunkSize]; // see-through blocks not yet in any component
+	FOR(z, ChunkSize) FOR(y, ChunkSize)
+	{
+		uint16_t m = 0;
+		const Block* row = blocks.getp(glm::ivec3(0, y, z));
+		FOR(x, ChunkSize) if (can_see_through(row[x])) m |= 1u << x;
+		see[z][y] = left[z][y] = m;
+	}
+
+	uint16_t comp[ChunkSize][ChunkSize];
+	bool queued[ChunkSize][ChunkSize];
+	uint8_t queue[ChunkSize * ChunkSize]; // circular, z * ChunkSize + y, each row at most once
+	uint64_t connectivity = 0;
+	FOR(z0, ChunkSize) FOR(y0, ChunkSize) while (left[z0][y0])
+	{
+		memset(comp, 0, sizeof(comp));
+		memset(queued, 0, sizeof(queued));
+		comp[z0][y0] = fill_runs(left[z0][y0] & -left[z0][y0], see[z0][y0]);
+		uint8_t head = 0, tail = 0;
+		int size = 1;
+		queue[tail++] = z0 * ChunkSize + y0;
+		queued[z0][y0] = true;
+		while (size > 0)
+		{
+			int z = queue[head] / ChunkSize, y = queue[head] % ChunkSize;
+			head += 1;
+			size -= 1;
+			queued[z][y] = false;
+			uint16_t m = comp[z][y];
+			const int dz[4] = { -1, 1, 0, 0 }, dy[4] = { 0, 0, -1, 1 };
+			FOR(i, 4)
+			{
+				int nz = z + dz[i], ny = y + dy[i];
+				if (nz < 0 || nz >= ChunkSize || ny < 0 || ny >= ChunkSize) continue;
+				uint16_t n = m & see[nz][ny] & ~comp[nz][ny];
+				if (!n) continue;
+				comp[nz][ny] |= fill_runs(n, see[nz][ny]);
+				if (queued[nz][ny]) continue;
+				queued[nz][ny] = true;
+				queue[tail++] = nz * ChunkSize + ny;
+				size += 1;
+			}
+		}
+
+		uint faces = 0;
+		uint16_t any = 0;
+		FOR(z, ChunkSize) FOR(y, ChunkSize)
+		{
+			uint16_t m = comp[z][y];
+			left[z][y] &= ~m;
+			any |= m;
+			if (m && y == 0) faces |= 1u << 2;
+			if (m && y == ChunkSize - 1) faces |= 1u << 3;
+			if (m && z == 0) faces |= 1u << 4;
+			if (m && z == ChunkSize - 1) faces |= 1u << 5;
+		}
+		if (any & 1) faces |= 1u << 0;
+		if (any & (1u << (ChunkSize - 1))) faces |= 1u << 1;
+		FOR(a, 6) if (faces & (1u << a)) connectivity |= uint64_t(faces) << (a * 6);
+		if (connectivity == AllFacesConnected) return connectivity;
+	}
+	return connectivity;
+}
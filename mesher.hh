@@ -0,0 +1,191 @@
+#pragma once
+#include "util.hh"
+#include "block.hh"
+
+// Chunk meshing: BlockRenderer turns chunk (with its neighbors) into quads. Doesn't depend on GL, so that it
+// can be measured without window (see meshbench.cc).
+
+namespace Cube
+{
+	extern glm::ivec3 corner[8];
+	extern const int faces[6][4];
+	extern glm::i8vec3 lightmap[6/*face*/][8/*vertex*/][4/*four blocks around vertex affecting light of vertex*/];
+	extern glm::i8vec3 lightmap2[6/*face*/][8/*vertex*/][4*3/*three blocks around four blocks around vertex affecting light of vertex*/];
+}
+
+struct Quad
+{
+	glm::u8vec3 pos[4]; // TODO: replace with x y w h
+	BlockTexture texture; // highest bit: isUnderwater
+	uint16_t light; // 4 bits per vertex
+	uint16_t plane; // hi byte: plane normal (face), lo byte: plane offset
+};
+
+// relative to chunk, in blocks
+glm::vec3 centroid(const Quad& q);
+
+// Planes (0 to ChunkSize on each axis) of chunk mesh which have to be regenerated, bit i of axis[a] is plane i.
+// Quad on plane P belongs to block P-1 or P, and its light depends on blocks up to 2 away in front of it.
+struct DirtyPlanes
+{
+	uint32_t axis[3];
+
+	static DirtyPlanes none() { return { { 0, 0, 0 } }; }
+	static DirtyPlanes all() { const uint32_t a = (2u << ChunkSize) - 1; return { { a, a, a } }; }
+
+	// quads which can change when any block in box [lo, hi] changes (box is relative to chunk, and can be outside)
+	static DirtyPlanes around(glm::ivec3 lo, glm::ivec3 hi)
+	{
+		DirtyPlanes d;
+		FOR(a, 3)
+		{
+			int p = std::max(lo[a] - 1, 0), q = std::min(hi[a] + 2, ChunkSize);
+			if (p > q) return none();
+			d.axis[a] = ((2u << q) - 1) & ~((1u << p) - 1);
+		}
+		return d;
+	}
+
+	bool empty() const { return (axis[0] | axis[1] | axis[2]) == 0; }
+	bool full() const { return (axis[0] & axis[1] & axis[2]) == all().axis[0]; }
+	// top of partial water block is inside the block, but it is lit like a full top face
+	bool has(const Quad& q) const { return axis[q.plane >> 9] & (1u << ((q.plane & 0xFF) + 14) / 15); }
+	void add(const DirtyPlanes& e) { FOR(a, 3) axis[a] |= e.axis[a]; }
+};
+
+// Which faces of chunk can be seen from which other faces, through see-through blocks: bit a*6+b is set if
+// faces a and b (as in face_dir) are connected.
+const uint64_t AllFacesConnected = (1ull << 36) - 1;
+inline bool faces_connected(uint64_t connectivity, int a, int b) { return (connectivity >> (a * 6 + b)) & 1; }
+uint64_t face_connectivity(const Blocks& blocks);
+
+struct BlockRenderer
+{
+	std::vector<Quad>* m_quads;
+	std::vector<Quad> m_quadsp;
+	glm::ivec3 m_pos;
+	Block m_block;
+
+	std::vector<Quad> m_xy, m_yx;
+
+	// V1
+	const Blocks** m_chunks; // 3x3x3 cube
+	DirtyPlanes m_dirty; // only quads on these planes are generated
+
+	// Chunk with 2 blocks of its neighbors around it (as far as light reaches), copied before meshing, [z+2][y+2][x+2]
+	static const int Padded = ChunkSize + 4;
+	Block m_padded[Padded][Padded][Padded];
+	// light contribution of block: 2 for none, 1 for other see-through, 0 for opaque
+	uint8_t m_weight[Padded][Padded][Padded];
+	// m_padded (and m_weight) were built by neighborhood_hash for m_chunks, and next append_quads can use them
+	bool m_padded_ready = false;
+
+	// V2
+	// Idea: if mapchunks are shifted 8 blocks on each axis then each render chunk would only depend on 2x2x2 mapchunks (8 instead of 27)
+	// Problem: how to parallelize loading when player moves?
+	// - worker threads only load superchunks and generate chunks (if mapchunk is not ready by buffer time, just use pointer to zero memory or full with some special block types)
+	// - renderchunks are generated by main thread on demand (if chunk is going to be rendered and is dirty)
+	// How does it affect the current and replacement raytracers?/
+	//MapChunkLight m_mcl[3][3][3];
+
+	/*Block get_v2(glm::ivec3 rel)
+	{
+		glm::ivec3 a = m_fpos + rel;
+		glm::ivec3 b = (a - corner) >> ChunkSizeBits;
+		return m_mcl[b.x][b.y][b.z].get(a & ChunkSizeMask);
+	}*/
+
+	Block get(glm::ivec3 rel);
+	void build_padded();
+
+	// full resolution mesh depends only on padded neighborhood
+	// (which is kept for the following generate_quads / regenerate_quads of the same chunks)
+	uint64_t neighborhood_hash(const Blocks* chunks[27]);
+
+	// Same as face_light2(face) for each block x of row (y, z), 16 blocks at once.
+	void row_light(int face, int y, int z, uint16_t light[ChunkSize]);
+	uint8_t face_light(int face);
+	uint16_t face_light2(int face);
+	void draw_quad(int face, bool reverse, bool underwater_overlay);
+	void draw_quad(int face, int zmin, int zmax, bool reverse, bool underwater_overlay);
+	Block get(int face) { return get(face_dir[face]); }
+
+	template<bool side>
+	void draw_non_water_face(int face);
+	void draw_water_side(int face, int w);
+	void draw_water_bottom();
+	void draw_water_top(int w);
+
+	// Bit x+1 is set for block x (from -1 to ChunkSize) of row
+	struct RowMasks
+	{
+		uint32_t solid; // not none
+		uint32_t water; // any water
+		uint32_t full_water;
+		uint32_t see; // can_see_through
+	};
+
+	RowMasks m_rows[ChunkSize + 2][ChunkSize + 2]; // [z+1][y+1], rows outside of chunk on both axes are unused
+
+	// faces of full blocks (not water, not next to water) which can be merged, bit x is set for block x
+	uint16_t m_visible[6][ChunkSize][ChunkSize]; // [face][z][y]
+
+	struct Layer
+	{
+		uint16_t rows[ChunkSize]; // [v] bit u
+		uint32_t keys[ChunkSize][ChunkSize]; // [v][u] texture | (light << 16)
+	};
+	Layer m_layers[ChunkSize];
+
+	struct Rect
+	{
+		uint8_t u, v, w, h;
+		uint32_t key;
+	};
+	Rect m_rects[2][ChunkSize * ChunkSize];
+
+	// Greedy rectangles of equal keys: take run of bits in row, extend it over following rows while they contain it.
+	// With Transposed runs are along v instead. Returns number of rectangles.
+	template<bool Transposed>
+	static int greedy(const Layer& layer, Rect* out);
+	static RowMasks row_masks(const Block* row);
+	static void add_block(RowMasks& m, int x, Block b);
+	void build_row_masks();
+	void draw_water_block(glm::ivec3 p);
+
+	// Faces of non-water blocks next to water are drawn one by one (they can be partial or underwater).
+	// Faces hidden by the same see-through block are removed from visible.
+	void find_visible_faces();
+	void emit_quad(int face, glm::ivec3 lo, glm::ivec3 ext, uint32_t key);
+
+	// Greedy meshing of visible faces in each layer, merging rectangles of equal texture and light.
+	// Leaves and blended faces are drawn one by one, and merged (or not) with other special faces later.
+	void mesh_visible_faces(bool merge, std::vector<Quad>& out);
+
+	// layer l of face, in cells of scale blocks
+	void emit_layer(int face, int l, const Layer& layer, bool merge, int scale);
+
+	// Level of detail: chunk is meshed as cells of 2^lod blocks. Cell is the most common block if at least half of
+	// its blocks aren't none (all water levels count as water). Otherwise it is none, unless it has a block on the
+	// chunk border (which the neighbor could have hidden its own face behind). All border faces are drawn, as the
+	// neighbor can be at a different level. Light is full, as far chunks are too far for AO to be visible.
+	Block m_cells[ChunkSize / 2 + 2][ChunkSize / 2 + 2][ChunkSize / 2 + 2]; // [z+1][y+1][x+1]
+
+	static Block majority(const Blocks* chunk, glm::ivec3 lo, int s);
+	Block cell(glm::ivec3 c) { return m_cells[c.z + 1][c.y + 1][c.x + 1]; }
+
+	void generate_lod_quads(const Blocks* chunks[27], int lod, std::vector<Quad>& out, int& blended_quads);
+
+	// Visible faces are found with bit masks of 16 blocks at once, and merged without sorting.
+	// Faces of water, next to water, leaves and blended are collected in m_quadsp and merged by merge_quads.
+	void generate_quads(glm::ivec3 cpos, const Blocks* chunks[27], bool merge, std::vector<Quad>& out, int& blended_quads);
+
+	// Partial remesh: quads of old mesh on clean planes are kept, and only dirty planes are generated again.
+	// Quads are only ever merged within a plane, so result is the same as from generate_quads (up to order).
+	void regenerate_quads(glm::ivec3 cpos, const Blocks* chunks[27], const DirtyPlanes& dirty, const std::vector<Quad>& old, std::vector<Quad>& out, int& blended_quads);
+	void append_quads(glm::ivec3 cpos, const Blocks* chunks[27], const DirtyPlanes& dirty, bool merge, std::vector<Quad>& out);
+	static int count_blended(const std::vector<Quad>& quads);
+	static bool combine(Quad& a, Quad b, int X, int Y);
+	static void merge_axis(std::vector<Quad>& quads, int X, int Y);
+	void merge_quads(std::vector<Quad>& out);
+};
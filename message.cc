@@ -27,3 +27,14 @@ void write_text_message(SocketBuffer& send, const char* fmt, ...)
 	send.write(&message, sizeof(MessageText));
 	send.write(&buffer, length);
 }
+
+MessageBlockUpdates* read_block_updates(SocketBuffer& recv)
+{
+	if (recv.size() < sizeof(MessageBlockUpdates)) return nullptr;
+	MessageBlockUpdates* message = reinterpret_cast<MessageBlockUpdates*>(recv.data());
+	assert(message->type == MessageType::BlockUpdates);
+	uint size = sizeof(MessageBlockUpdates) + sizeof(BlockUpdate) * (uint)message->count;
+	if (recv.size() < size) return nullptr;
+	recv.read_message(size);
+	return message;
+}
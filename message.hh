@@ -7,7 +7,8 @@ enum class MessageType : uint8_t
 	Text = 0,
 	AvatarState = 1,
 	ChunkState = 2,
-	ServerStatus = 3
+	ServerStatus = 3,
+	BlockUpdates = 4
 };
 
 struct MessageText
@@ -32,6 +33,20 @@ struct MessageChunkState
 	Block blocks[ChunkSize3];
 } __attribute__((packed));
 
+struct BlockUpdate
+{
+	uint16_t index; // index of block inside chunk
+	Block block;
+} __attribute__((packed));
+
+struct MessageBlockUpdates
+{
+	MessageType type;
+	glm::ivec3 cpos;
+	uint16_t count;
+	BlockUpdate updates[0]; // <count> updates follow!
+} __attribute__((packed));
+
 struct MessageServerStatus
 {
 	MessageType type;
@@ -42,9 +57,11 @@ struct MessageServerStatus
 	uint16_t simulation_time;
 	uint16_t chunk_time;
 	uint16_t avatar_time;
+	uint16_t simulation_backlog; // active chunks waiting for simulation
 	uint32_t frame;
 } __attribute__((packed));
 
 struct SocketBuffer;
 MessageText* read_text_message(SocketBuffer& recv);
 void write_text_message(SocketBuffer& send, const char* fmt, ...);
+MessageBlockUpdates* read_block_updates(SocketBuffer& recv);
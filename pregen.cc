@@ -0,0 +1,25 @@
+#include "util.hh"
+
+// Generates world ahead of time, so that chunks don't have to be generated while players explore.
+
+extern const char* g_world_dir;
+bool server_pregen(glm::ivec3 center, int radius, uint threads);
+
+int main(int argc, char** argv)
+{
+	void sigsegv_handler(int sig);
+	signal(SIGSEGV, sigsegv_handler);
+
+	if (argc < 5 || argc > 7)
+	{
+		printf("usage: %s <chunk x> <chunk y> <chunk z> <radius in chunks> [threads] [world dir]\n", argv[0]);
+		return 0;
+	}
+	glm::ivec3 center(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]));
+	int radius = atoi(argv[4]);
+	uint threads = (argc >= 6) ? uint(atoi(argv[5])) : std::thread::hardware_concurrency();
+	if (argc == 7) g_world_dir = argv[6];
+
+	Timestamp::calibrate();
+	return server_pregen(center, radius, threads) ? 0 : 1;
+}
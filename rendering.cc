@@ -28,6 +28,149 @@ int gen_buffer(GLenum target, GLsizei size, const void* data)
 	return buffer;
 }
 
+// BufferArena
+
+BufferArena::BufferArena(uint32_t element_size, uint32_t capacity, uint32_t page)
+	: m_element_size(element_size), m_page(page), m_capacity(capacity), m_used(0), m_buffer(0), m_page_buffer(0)
+{
+	assert(capacity % page == 0);
+}
+
+void BufferArena::init()
+{
+	assert(m_buffer == 0);
+	glGenBuffers(1, &m_buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, m_capacity * m_element_size, nullptr, GL_STATIC_DRAW);
+	m_free.push_back(Range{ 0, m_capacity });
+	if (m_page > 1)
+	{
+		glGenBuffers(1, &m_page_buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, m_page_buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, m_capacity / m_page * sizeof(uint32_t), nullptr, GL_STATIC_DRAW);
+	}
+}
+
+uint32_t BufferArena::alloc(uint32_t count)
+{
+	assert(count > 0 && m_buffer != 0);
+	count = (count + m_page - 1) / m_page * m_page;
+	auto fit = [&]() { return std::find_if(m_free.begin(), m_free.end(), [count](Range r) { return r.size >= count; }); };
+	auto it = fit();
+	if (it == m_free.end())
+	{
+		// compact if there is enough space in total, otherwise grow as well
+		relocate((m_capacity - m_used >= count) ? m_capacity : std::max(m_capacity * 2, m_used + count));
+		it = fit();
+	}
+
+	Range range{ it->offset, count };
+	it->offset += count;
+	it->size -= count;
+	if (it->size == 0) m_free.erase(it);
+	m_used += count;
+
+	uint32_t handle;
+	if (m_free_handles.empty())
+	{
+		m_ranges.push_back(range);
+		handle = m_ranges.size() - 1;
+	}
+	else
+	{
+		handle = m_free_handles.back();
+		m_free_handles.pop_back();
+		m_ranges[handle] = range;
+	}
+	if (m_page > 1) write_pages(handle);
+	return handle;
+}
+
+void BufferArena::write_pages(uint32_t handle)
+{
+	const Range& range = m_ranges[handle];
+	std::vector<uint32_t> owners(range.size / m_page, handle);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_page_buffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, range.offset / m_page * sizeof(uint32_t), owners.size() * sizeof(uint32_t), owners.data());
+}
+
+void BufferArena::free(uint32_t handle)
+{
+	Range range = m_ranges[handle];
+	assert(range.size > 0);
+	m_ranges[handle].size = 0;
+	m_free_handles.push_back(handle);
+	m_used -= range.size;
+
+	// insert and merge with neighbors
+	auto it = std::lower_bound(m_free.begin(), m_free.end(), range, [](Range a, Range b) { return a.offset < b.offset; });
+	if (it != m_free.begin() && (it - 1)->offset + (it - 1)->size == range.offset)
+	{
+		it -= 1;
+		it->size += range.size;
+	}
+	else
+	{
+		it = m_free.insert(it, range);
+	}
+	if (it + 1 != m_free.end() && it->offset + it->size == (it + 1)->offset)
+	{
+		it->size += (it + 1)->size;
+		m_free.erase(it + 1);
+	}
+}
+
+void BufferArena::upload(uint32_t handle, uint32_t first, uint32_t count, const void* data)
+{
+	const Range& range = m_ranges[handle];
+	assert(first + count <= range.size);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (range.offset + first) * m_element_size, count * m_element_size, data);
+}
+
+// Copies all allocations to the start of a new buffer (on GPU), leaving one free range at the end.
+void BufferArena::relocate(uint32_t capacity)
+{
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, capacity * m_element_size, nullptr, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_READ_BUFFER, m_buffer);
+
+	std::vector<uint32_t> live;
+	FOR(i, m_ranges.size()) if (m_ranges[i].size > 0) live.push_back(i);
+	std::sort(live.begin(), live.end(), [this](uint32_t a, uint32_t b) { return m_ranges[a].offset < m_ranges[b].offset; });
+
+	uint32_t offset = 0;
+	for (uint32_t handle : live)
+	{
+		Range& r = m_ranges[handle];
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, r.offset * m_element_size, offset * m_element_size, r.size * m_element_size);
+		r.offset = offset;
+		offset += r.size;
+	}
+	assert(offset == m_used);
+
+	glDeleteBuffers(1, &m_buffer);
+	m_buffer = buffer;
+	m_capacity = capacity;
+	m_free.clear();
+	if (m_used < m_capacity) m_free.push_back(Range{ m_used, m_capacity - m_used });
+
+	if (m_page > 1)
+	{
+		std::vector<uint32_t> owners(m_capacity / m_page, Null);
+		for (uint32_t handle : live)
+		{
+			const Range& r = m_ranges[handle];
+			std::fill(owners.begin() + r.offset / m_page, owners.begin() + (r.offset + r.size) / m_page, handle);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, m_page_buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, owners.size() * sizeof(uint32_t), owners.data(), GL_STATIC_DRAW);
+	}
+	fprintf(stderr, "BufferArena: relocated %u elements, capacity %u\n", m_used, m_capacity);
+}
+
 // Render::Texture
 
 #define LODEPNG_COMPILE_CPP
@@ -125,6 +268,14 @@ GLuint load_program(const char* name, bool geometry)
 	return make_program(shaders);
 }
 
+GLuint load_program(const char* vertex_name, const char* fragment_name)
+{
+	ivector<GLuint, 3> shaders;
+	shaders.push_back(load_shader(GL_VERTEX_SHADER, vertex_name, "vert"));
+	shaders.push_back(load_shader(GL_FRAGMENT_SHADER, fragment_name, "frag"));
+	return make_program(shaders);
+}
+
 // Render::Text
 
 static GLuint text_texture;
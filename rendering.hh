@@ -19,7 +19,48 @@
 void Error(const char* name);
 
 int gen_buffer(GLenum target, GLsizei size, const void* data);
+
+// Keeps many small arrays of elements (ie. chunk meshes) in one large GL buffer, so they stay in GPU memory.
+// Ranges are allocated first-fit from a free list. Allocations are referred to by handle, as their offset
+// changes when buffer gets compacted (if no free range is large enough) or grown.
+class BufferArena
+{
+public:
+	static const uint32_t Null = ~0u;
+
+	// With page > 1 allocations start at page boundary, and page_buffer() has owner handle (uint32_t) of each page.
+	BufferArena(uint32_t element_size, uint32_t capacity, uint32_t page = 1);
+	void init(); // once GL context exists
+
+	uint32_t alloc(uint32_t count);
+	void free(uint32_t handle);
+	// count elements starting from element first of allocation
+	void upload(uint32_t handle, uint32_t first, uint32_t count, const void* data);
+
+	uint32_t offset(uint32_t handle) const { return m_ranges[handle].offset; } // in elements
+	GLuint buffer() const { return m_buffer; }
+	GLuint page_buffer() const { return m_page_buffer; }
+	uint32_t used_bytes() const { return m_used * m_element_size; }
+	uint32_t capacity_bytes() const { return m_capacity * m_element_size; }
+
+private:
+	void relocate(uint32_t capacity);
+	void write_pages(uint32_t handle);
+
+	struct Range
+	{
+		uint32_t offset, size;
+	};
+
+	const uint32_t m_element_size, m_page;
+	uint32_t m_capacity, m_used;
+	GLuint m_buffer, m_page_buffer;
+	std::vector<Range> m_ranges; // by handle
+	std::vector<uint32_t> m_free_handles;
+	std::vector<Range> m_free; // sorted by offset, no two adjacent
+};
 GLuint load_program(const char* name, bool geometry = false);
+GLuint load_program(const char* vertex_name, const char* fragment_name);
 void load_png_texture(std::string filename);
 
 class Text
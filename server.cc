@@ -6,14 +6,30 @@
 #include "maplock.hh"
 #include "auto.hh"
 #include "lz4.h"
-
-#include <unordered_map>
+#include "city.h"
 
 void generate_chunk(Blocks& chunk, glm::ivec3 cpos);
 
 // =============
 
-Sphere g_server_render_sphere(40/*RenderDistance*/);
+Sphere g_server_render_sphere(RenderDistance);
+
+const char* g_world_dir = "../world";
+
+// Everything from clients that affects simulation is recorded for later replay (see server_replay)
+FILE* g_record = nullptr;
+uint g_server_frame = 0;
+
+void record(const char* fmt, ...)
+{
+	if (!g_record) return;
+	fprintf(g_record, "%u ", g_server_frame);
+	va_list va;
+	va_start(va, fmt);
+	vfprintf(g_record, fmt, va);
+	va_end(va);
+	fputc('\n', g_record);
+}
 
 struct ServerAvatar
 {
@@ -33,7 +49,7 @@ struct Connection
 
 	glm::ivec3 m_cpos;
 	XCube<MapSize, glm::ivec3> m_chunks;
-	int m_scaned_chunks;
+	uint m_scaned_chunks;
 
 	Connection()
 	{
@@ -42,16 +58,18 @@ struct Connection
 		m_chunks.clear(x_bad_ivec3);
 	}
 
-	void update_cpos()
+	void set_cpos(glm::ivec3 cpos)
 	{
-		glm::ivec3 cpos = glm::ivec3(glm::floor(avatar.position)) >> ChunkSizeBits;
 		if (m_cpos != cpos)
 		{
 			m_cpos = cpos;
 			m_scaned_chunks = 0;
+			record("cpos %d %d %d %d", avatar.id, cpos.x, cpos.y, cpos.z);
 		}
 	}
 
+	void update_cpos() { set_cpos(glm::ivec3(glm::floor(avatar.position)) >> ChunkSizeBits); }
+
 	bool exchange()
 	{
 		return recv_buffer.recv_any(sock) && send_buffer.send_any(sock);
@@ -59,13 +77,35 @@ struct Connection
 
 	void send_chunk(glm::ivec3 cpos, const Blocks& chunk)
 	{
-		assert(glm::distance2(m_cpos, cpos) <= sqr(40/*RenderDistance*/));
+		assert(glm::distance2(m_cpos, cpos) <= sqr(RenderDistance));
 		auto message = send_buffer.write<MessageChunkState>();
 		message->type = MessageType::ChunkState;
 		message->cpos = cpos;
 		assert(sizeof(chunk) == sizeof(MessageChunkState::blocks));
 		memcpy(message->blocks, &chunk, sizeof(chunk));
-		m_chunks[cpos & MapSizeBits] = cpos;
+		m_chunks[cpos & MapSizeMask] = cpos;
+	}
+
+	// changes are sorted indices of changed blocks
+	void send_block_updates(glm::ivec3 cpos, const Blocks& chunk, const std::vector<uint16_t>& changes)
+	{
+		// resending the whole chunk is cheaper if most of it changed
+		if (changes.size() * sizeof(BlockUpdate) >= sizeof(MessageChunkState) / 2)
+		{
+			send_chunk(cpos, chunk);
+			return;
+		}
+		uint size = sizeof(MessageBlockUpdates) + sizeof(BlockUpdate) * changes.size();
+		send_buffer.ensure_space(size);
+		auto message = reinterpret_cast<MessageBlockUpdates*>(send_buffer.write_message(size));
+		message->type = MessageType::BlockUpdates;
+		message->cpos = cpos;
+		message->count = changes.size();
+		FOR(i, changes.size())
+		{
+			message->updates[i].index = changes[i];
+			message->updates[i].block = chunk.data()[changes[i]];
+		}
 	}
 };
 
@@ -86,18 +126,29 @@ struct SuperChunk
 
 	BitCube<SuperChunkSize> active;
 
+	// chunks with block changes not yet sent to clients
+	BitCube<SuperChunkSize> dirty;
+	std::vector<uint16_t> changes[SuperChunkSize * SuperChunkSize * SuperChunkSize];
+
+	// number of ticks active chunk has been waiting for simulation
+	uint16_t waiting[SuperChunkSize * SuperChunkSize * SuperChunkSize];
+
 	bool load();
 	bool save();
 
-	SuperChunk(glm::ivec3 _scpos) : scpos(_scpos), refs(0), data(nullptr) { }
+	SuperChunk(glm::ivec3 _scpos) : scpos(_scpos), refs(0), data(nullptr)
+	{
+		dirty.clear_all();
+		memset(waiting, 0, sizeof(waiting));
+	}
 	BitCubeExplored& explored() { return *reinterpret_cast<BitCubeExplored*>(data + BlockCubeFileSize); }
 	Blocks& chunk(glm::ivec3 cpos);
+	static int chunk_index(glm::ivec3 cpos) { return (((cpos.x << SuperChunkSizeBits) | cpos.y) << SuperChunkSizeBits) | cpos.z; }
 };
 
 Blocks& SuperChunk::chunk(glm::ivec3 cpos)
 {
-	int i = (((cpos.x << ChunkSizeBits) | cpos.y) << ChunkSizeBits) | cpos.z;
-	Block* blocks = reinterpret_cast<Block*>(data) + i * ChunkSize3;
+	Block* blocks = reinterpret_cast<Block*>(data) + chunk_index(cpos) * ChunkSize3;
 	return *reinterpret_cast<Blocks*>(blocks);
 }
 
@@ -105,11 +156,11 @@ bool SuperChunk::load()
 {
 	modified = false;
 	assert(!data);
-	data = (uint8_t*)malloc(DataSize);
+	data = (uint8_t*)calloc(DataSize, 1); // zeroed, so that unexplored chunks are deterministic
 	CHECK(data);
 
 	char* filename = nullptr;
-	CHECK(0 < asprintf(&filename, "../world/world.%+d%+d%+d.sc", scpos.x, scpos.y, scpos.z));
+	CHECK(0 < asprintf(&filename, "%s/world.%+d%+d%+d.sc", g_world_dir, scpos.x, scpos.y, scpos.z));
 	Auto(free(filename));
 
 	FILE* file = fopen(filename, "r");
@@ -134,7 +185,7 @@ bool SuperChunk::load()
 	CHECK(buffer);
 	Auto(free(buffer));
 
-	CHECK(fread(buffer, 1, size, file) == size);
+	CHECK(fread(buffer, 1, size, file) == size_t(size));
 	CHECK(LZ4_decompress_safe(buffer, (char*)data, size, DataSize) == DataSize);
 	return true;
 }
@@ -144,7 +195,7 @@ bool SuperChunk::save()
 	if (!modified) return true;
 
 	char* filename = nullptr;
-	CHECK(0 < asprintf(&filename, "../world/world.%+d%+d%+d.sc", scpos.x, scpos.y, scpos.z));
+	CHECK(0 < asprintf(&filename, "%s/world.%+d%+d%+d.sc", g_world_dir, scpos.x, scpos.y, scpos.z));
 	Auto(free(filename));
 
 	fprintf(stderr, "Saving super chunk [%d %d %d]\n", scpos.x, scpos.y, scpos.z);
@@ -156,7 +207,7 @@ bool SuperChunk::save()
 
 	FILE* file = fopen(filename, "w");
 	CHECK(file);
-	if (fwrite(buffer, 1, ret, file) != ret)
+	if (fwrite(buffer, 1, ret, file) != size_t(ret))
 	{
 		fprintf(stderr, "Failed to write %s\n", filename);
 		fclose(file);
@@ -168,27 +219,38 @@ bool SuperChunk::save()
 	return true;
 }
 
+// chunks changed during current simulation tick
+std::vector<glm::ivec3> g_dirty_chunks;
+
 struct Chunk
 {
 	glm::ivec3 icpos;
 	SuperChunk* sc;
 
 	glm::ivec3 get_cpos() { return icpos + (sc->scpos << SuperChunkSizeBits); }
-	void set(glm::ivec3 pos, Block b) { sc->chunk(icpos)[pos] = b; sc->modified = true; }
 	Block operator[](glm::ivec3 pos) const { return sc->chunk(icpos)[pos]; }
 	Blocks& blocks() { return sc->chunk(icpos); }
 
+	void set(glm::ivec3 pos, Block b)
+	{
+		Block& e = sc->chunk(icpos)[pos];
+		if (e == b) return;
+		e = b;
+		sc->modified = true;
+		if (sc->dirty.xset(icpos)) g_dirty_chunks.push_back(get_cpos());
+		sc->changes[SuperChunk::chunk_index(icpos)].push_back(block_index(pos));
+	}
 	bool is_active() { return sc->active[icpos]; }
 	void activate() { sc->active.set(icpos); }
 	void deactivate() { sc->active.clear(icpos); }
+	uint16_t& waiting() { return sc->waiting[SuperChunk::chunk_index(icpos)]; }
 };
 
 struct SuperChunkManager
 {
-	Blocks* acquire_chunk(glm::ivec3 cpos, bool generate)
+	// loads super chunk if needed
+	SuperChunk* acquire_super_chunk(glm::ivec3 scpos)
 	{
-		//AutoLock(m_lock);
-		glm::ivec3 scpos = cpos >> SuperChunkSizeBits;
 		SuperChunk* sc = m_map[scpos];
 		if (sc == nullptr)
 		{
@@ -198,6 +260,34 @@ struct SuperChunkManager
 			m_map[scpos] = sc;
 		}
 		sc->refs += 1;
+		return sc;
+	}
+
+	// saves and unloads super chunk once it has no references, returns false if saving failed
+	bool release_super_chunk(glm::ivec3 scpos)
+	{
+		SuperChunk* sc = m_map[scpos];
+		assert(sc);
+		assert(sc->refs > 0);
+		bool saved = true;
+		if (--sc->refs == 0)
+		{
+			if (!sc->save())
+			{
+				fprintf(stderr, "ERROR: Failed to save super chunk [%d %d %d]\n", scpos.x, scpos.y, scpos.z);
+				saved = false;
+			}
+			free(sc->data);
+			delete sc;
+			m_map.erase(scpos);
+		}
+		return saved;
+	}
+
+	Blocks* acquire_chunk(glm::ivec3 cpos, bool generate)
+	{
+		//AutoLock(m_lock);
+		SuperChunk* sc = acquire_super_chunk(cpos >> SuperChunkSizeBits);
 
 		Blocks& chunk = sc->chunk(cpos & SuperChunkSizeMask);
 		//m_lock.unlock();
@@ -219,20 +309,7 @@ struct SuperChunkManager
 	void release_chunk(glm::ivec3 cpos)
 	{
 		//AutoLock(m_lock);
-		glm::ivec3 scpos = cpos >> SuperChunkSizeBits;
-		SuperChunk* sc = m_map[scpos];
-		assert(sc);
-		assert(sc->refs > 0);
-		if (--sc->refs == 0)
-		{
-			if (!sc->save())
-			{
-				fprintf(stderr, "ERROR: Failed to save super chunk [%d %d %d]\n", scpos.x, scpos.y, scpos.z);
-			}
-			free(sc->data);
-			delete sc;
-			m_map.erase(m_map.find(scpos));
-		}
+		release_super_chunk(cpos >> SuperChunkSizeBits);
 	}
 
 	void save()
@@ -240,21 +317,37 @@ struct SuperChunkManager
 		fprintf(stderr, "Not saving!\n");
 		return;
 		//AutoLock(m_lock);
-		for (auto it : m_map)
-		{
-			if (!it.second->save())
+		m_map.for_each([](glm::ivec3 scpos, SuperChunk* sc) {
+			if (!sc->save())
 			{
-				glm::ivec3 a = it.second->scpos;
-				fprintf(stderr, "ERROR: Failed to save super chunk [%d %d %d]\n", a.x, a.y, a.z);
+				fprintf(stderr, "ERROR: Failed to save super chunk [%d %d %d]\n", scpos.x, scpos.y, scpos.z);
 			}
+		});
+	}
+
+	// Hash of all loaded super chunks, independent of load order
+	uint64_t hash()
+	{
+		std::vector<SuperChunk*> list;
+		m_map.for_each([&](glm::ivec3, SuperChunk* sc) { list.push_back(sc); });
+		std::sort(list.begin(), list.end(), [](SuperChunk* a, SuperChunk* b) {
+			if (a->scpos.x != b->scpos.x) return a->scpos.x < b->scpos.x;
+			if (a->scpos.y != b->scpos.y) return a->scpos.y < b->scpos.y;
+			return a->scpos.z < b->scpos.z; });
+		uint64_t h = 0;
+		for (SuperChunk* sc : list)
+		{
+			h = CityHash64WithSeed((const char*)&sc->scpos, sizeof(sc->scpos), h);
+			h = CityHash64WithSeed((const char*)sc->data, SuperChunk::DataSize, h);
 		}
+		return h;
 	}
 
 	Chunk get(glm::ivec3 cpos)
 	{
 		Chunk chunk;
-		auto it = m_map.find(cpos >> SuperChunkSizeBits);
-		chunk.sc = (it == m_map.end()) ? nullptr : it->second;
+		SuperChunk** e = m_map.find(cpos >> SuperChunkSizeBits);
+		chunk.sc = e ? *e : nullptr;
 		chunk.icpos = cpos & SuperChunkSizeMask;
 		return chunk;
 	}
@@ -263,28 +356,70 @@ private:
 	//MapLock<glm::ivec3> m_chunk_locks;
 
 	//std::mutex m_lock;
-	std::unordered_map<glm::ivec3, SuperChunk*> m_map;
+	SpatialMap<SuperChunk*> m_map;
 };
 
 SuperChunkManager g_scm;
 
 // =============
 
-struct BlockRef
+// Chunk and its 26 neighbors, looked up once, so that simulation rules don't touch g_scm for every block.
+// Positions are relative to the center chunk (from -ChunkSize to 2*ChunkSize-1).
+struct ChunkNeighborhood
 {
-	Chunk chunk;
-	glm::i8vec3 ipos;
-	Block block;
+	void init(glm::ivec3 cpos)
+	{
+		FOR(i, 27)
+		{
+			m_chunks[i] = g_scm.get(cpos + glm::ivec3(i / 9, i / 3 % 3, i % 3) - 1);
+			m_blocks[i] = m_chunks[i].sc ? &m_chunks[i].blocks() : nullptr;
+		}
+	}
+
+	bool has(glm::ivec3 p) const { return m_blocks[index(p)] != nullptr; }
+	// Block::none if chunk isn't loaded
+	Block get(glm::ivec3 p) const { const Blocks* b = m_blocks[index(p)]; return b ? (*b)[p & ChunkSizeMask] : Block::none; }
+
+	// also activates all chunks touching the block
+	void set(glm::ivec3 p, Block b)
+	{
+		m_chunks[index(p)].set(p & ChunkSizeMask, b);
+		glm::ivec3 a = ((p - ii) >> ChunkSizeBits) + 1;
+		glm::ivec3 c = ((p + ii) >> ChunkSizeBits) + 1;
+		FOR2(x, a.x, c.x) FOR2(y, a.y, c.y) FOR2(z, a.z, c.z)
+		{
+			Chunk& chunk = m_chunks[(x * 3 + y) * 3 + z];
+			if (chunk.sc) chunk.activate();
+		}
+	}
+
+	void activate_center() { m_chunks[13].activate(); }
+
+private:
+	static int index(glm::ivec3 p)
+	{
+		glm::ivec3 c = (p >> ChunkSizeBits) + 1;
+		assertf((uint)c.x < 3 && (uint)c.y < 3 && (uint)c.z < 3, "[%d %d %d]", p.x, p.y, p.z);
+		return (c.x * 3 + c.y) * 3 + c.z;
+	}
 
-	operator Block() { return block; }
-	BlockRef() { }
-	explicit BlockRef(glm::ivec3 p) : chunk(g_scm.get(p >> ChunkSizeBits)), ipos(p & ChunkSizeMask), block(chunk.sc ? chunk.sc->chunk(chunk.icpos)[glm::ivec3(ipos)] : Block::none) { }
+	Chunk m_chunks[27];
+	Blocks* m_blocks[27];
 };
 
 static const int SimulationDistance = 7; // in chunks
+float g_simulation_budget_ms = 4; // per tick, 0 for no limit
+uint g_simulation_limit = 0; // if > 0 exactly this many chunks are simulated per tick, instead of time budget (for replay)
+static const int SimulationAging = 4; // each tick of waiting is worth this much of squared distance (in chunks)
 
-static const int MaxActiveChunks = 100;
-std::vector<glm::ivec3> sim_active_chunks;
+std::vector<glm::ivec3> sim_active_chunks; // simulated in current tick
+uint sim_backlog = 0; // active chunks left for later ticks
+
+// all randomness in simulation comes from here, so that it can be replayed
+Random g_sim_random;
+
+// time spent in phases of the last server_simulate_blocks()
+float sim_schedule_ms, sim_blocks_ms, sim_gravity_ms, sim_updates_ms;
 
 void activate_block(glm::ivec3 pos)
 {
@@ -298,16 +433,6 @@ void activate_block(glm::ivec3 pos)
 	}
 }
 
-void update_block(BlockRef& ref, Block b)
-{
-	ref.block = b;
-	glm::ivec3 q(ref.ipos);
-	glm::ivec3 p = ref.chunk.get_cpos();
-	ref.chunk.set(glm::ivec3(ref.ipos), b);
-	glm::ivec3 pos = q + (p << ChunkSizeBits);
-	activate_block(pos);
-}
-
 Block get_block(glm::ivec3 pos)
 {
 	return g_scm.get(pos >> ChunkSizeBits)[pos & ChunkSizeMask];
@@ -332,15 +457,16 @@ const char* block_name_safe(Block block)
 }
 
 // returns true when src becomes empty
-bool water_flow(BlockRef& src, BlockRef& dest, int w)
+bool water_flow(ChunkNeighborhood& n, glm::ivec3 src, glm::ivec3 dest, int w)
 {
-	assert(water_level(dest) + w <= (uint)Block::water);
-	int base = (dest == Block::none) ? int(Block::water1) - 1 : int(dest.block);
-	update_block(dest, Block(base + w));
+	Block d = n.get(dest);
+	assert(water_level(d) + w <= (uint)Block::water);
+	int base = (d == Block::none) ? int(Block::water1) - 1 : int(d);
+	n.set(dest, Block(base + w));
 
-	int level = water_level(src);
+	int level = water_level(n.get(src));
 	assertf(w > 0 && w <= level, "w=%d level=%d", w, level);
-	update_block(src, (w == level) ? Block::none : Block(int(Block::water1) - 1 + level - w));
+	n.set(src, (w == level) ? Block::none : Block(int(Block::water1) - 1 + level - w));
 	return w == level;
 }
 
@@ -352,42 +478,44 @@ Initialize
 	FOR(x, ChunkSize) FOR(y, ChunkSize) sim_order.push_back(glm::i8vec2(x, y));
 }
 
-bool water_under(BlockRef b)
+bool water_under(const ChunkNeighborhood& n, glm::ivec3 p)
 {
-	BlockRef m((b.chunk.get_cpos() << ChunkSizeBits) + glm::ivec3(b.ipos) - iz);
-	return m.chunk.sc && m.block == Block::water;
+	return n.has(p - iz) && n.get(p - iz) == Block::water;
 }
 
-void model_simulate_water(BlockRef b, glm::ivec3 bpos)
+// p is relative to the center chunk of n
+void model_simulate_water(ChunkNeighborhood& n, glm::ivec3 p)
 {
-	int w = water_level(b);
+	int w = water_level(n.get(p));
 
 	// Flow down
-	BlockRef m(bpos - iz);
-	if (m.chunk.sc && accepts_water(m.block))
+	glm::ivec3 d = p - iz;
+	if (n.has(d) && accepts_water(n.get(d)))
 	{
-		int flow = std::min(w, (int)Block::water - water_level(m));
-		if (water_flow(b, m, flow)) return;
+		int flow = std::min(w, (int)Block::water - water_level(n.get(d)));
+		if (water_flow(n, p, d, flow)) return;
 		w -= flow;
 	}
 
 	// Flow sideways
 	if (w > 0)
 	{
-		ivector<BlockRef, 4> side;
+		Block b = n.get(p);
+		ivector<glm::ivec3, 4> side;
 		for (auto v : { -ix, ix, -iy, iy })
 		{
-			BlockRef q(bpos + v);
-			if (q.chunk.sc && (q == Block::none || (q >= Block::water1 && q < b))) side.push_back(q);
+			Block q = n.get(p + v);
+			if (n.has(p + v) && (q == Block::none || (q >= Block::water1 && q < b))) side.push_back(p + v);
 		}
 		while (side.size() > 0)
 		{
-			int e = rand() % side.size();
-			BlockRef m = side[e];
-			if ((water_level(m) < w) && (w > 1 || water_under(m)))
+			int e = g_sim_random.next(side.size());
+			glm::ivec3 m = side[e];
+			int level = water_level(n.get(m));
+			if ((level < w) && (w > 1 || water_under(n, m)))
 			{
-				int flow = (w - water_level(m) + 1) / 2;
-				water_flow(b, m, flow);
+				int flow = (w - level + 1) / 2;
+				water_flow(n, p, m, flow);
 				w -= flow;
 			}
 			side[e] = side[side.size() - 1];
@@ -398,21 +526,23 @@ void model_simulate_water(BlockRef b, glm::ivec3 bpos)
 	// Flow diagonaly
 	if (w > 0)
 	{
-		ivector<BlockRef, 4> side;
+		Block b = n.get(p);
+		ivector<glm::ivec3, 4> side;
 		FOR(j, 4)
 		{
 			glm::ivec3 xx((j%2)*2-1, 0, 0), yy(0, (j/2)*2-1, 0);
-			BlockRef px(bpos + xx), py(bpos + yy), q(bpos + xx + yy);
-			if (px.chunk.sc && accepts_water(px) && py.chunk.sc && accepts_water(py) && q.chunk.sc && (q == Block::none || (q >= Block::water1 && q < b))) side.push_back(q);
+			Block q = n.get(p + xx + yy);
+			if (n.has(p + xx) && accepts_water(n.get(p + xx)) && n.has(p + yy) && accepts_water(n.get(p + yy)) && n.has(p + xx + yy) && (q == Block::none || (q >= Block::water1 && q < b))) side.push_back(p + xx + yy);
 		}
 		while (side.size() > 0)
 		{
-			int e = rand() % side.size();
-			BlockRef m = side[e];
-			if ((water_level(m) < w) && (w > 1 || water_under(m)))
+			int e = g_sim_random.next(side.size());
+			glm::ivec3 m = side[e];
+			int level = water_level(n.get(m));
+			if ((level < w) && (w > 1 || water_under(n, m)))
 			{
-				int flow = (w - water_level(m) + 1) / 2;
-				water_flow(b, m, flow);
+				int flow = (w - level + 1) / 2;
+				water_flow(n, p, m, flow);
 				w -= flow;
 			}
 			side[e] = side[side.size() - 1];
@@ -423,93 +553,90 @@ void model_simulate_water(BlockRef b, glm::ivec3 bpos)
 	// Flow down sideways
 	if (w == 1)
 	{
-		ivector<BlockRef, 4> side;
+		ivector<glm::ivec3, 4> side;
 		for (auto v : { -ix, ix, -iy, iy })
 		{
-			BlockRef p(bpos + v), q(bpos + v - iz);
-			if (p.chunk.sc && p == Block::none && q.chunk.sc && accepts_water(q)) side.push_back(q);
+			glm::ivec3 q = p + v - iz;
+			if (n.has(p + v) && n.get(p + v) == Block::none && n.has(q) && accepts_water(n.get(q))) side.push_back(q);
 		}
 		if (side.size() > 0)
 		{
-			BlockRef m = side[rand() % side.size()];
-			if (water_flow(b, m, 1)) return;
+			if (water_flow(n, p, side[g_sim_random.next(side.size())], 1)) return;
 		}
 	}
 
 	// Flow down diagonaly
 	if (w == 1)
 	{
-		ivector<BlockRef, 4> side;
+		ivector<glm::ivec3, 4> side;
 		FOR(j, 4)
 		{
 			glm::ivec3 xx((j%2)*2-1, 0, 0), yy(0, (j/2)*2-1, 0);
-			BlockRef p(bpos + xx + yy), px(bpos + xx), py(bpos + yy), q(bpos + xx + yy - iz);
-			if (p.chunk.sc && p == Block::none && px.chunk.sc && px == Block::none && py.chunk.sc && py == Block::none && q.chunk.sc && accepts_water(q)) side.push_back(q);
+			glm::ivec3 q = p + xx + yy - iz;
+			if (n.has(p + xx + yy) && n.get(p + xx + yy) == Block::none && n.has(p + xx) && n.get(p + xx) == Block::none && n.has(p + yy) && n.get(p + yy) == Block::none && n.has(q) && accepts_water(n.get(q))) side.push_back(q);
 		}
 		if (side.size() > 0)
 		{
-			BlockRef m = side[rand() % side.size()];
-			if (water_flow(b, m, 1)) return;
+			if (water_flow(n, p, side[g_sim_random.next(side.size())], 1)) return;
 		}
 	}
 
 	// Evaporate
 	if (w == 1)
 	{
-		if (rand() % 100 == 0)
+		if (g_sim_random.next(100) == 0)
 		{
-			update_block(b, Block::none);
+			n.set(p, Block::none);
 		}
 		else
 		{
-			b.chunk.activate();
+			n.activate_center();
 		}
 	}
 	if (w == 14)
 	{
-		if (rand() % 100 == 0)
+		if (g_sim_random.next(100) == 0)
 		{
-			update_block(b, Block::water);
+			n.set(p, Block::water);
 		}
 		else
 		{
-			b.chunk.activate();
+			n.activate_center();
 		}
 	}
 }
 
-void model_simulate_block(glm::ivec3 pos)
+// p is relative to the center chunk of n
+void model_simulate_block(ChunkNeighborhood& n, glm::ivec3 p)
 {
-	BlockRef b(pos);
-	if (is_water(b)) model_simulate_water(b, pos);
+	Block b = n.get(p);
+	if (is_water(b)) model_simulate_water(n, p);
 	else if (is_sand(b))
 	{
 		// Flow down swapping with water
-		BlockRef m(pos - iz);
-		if (m.chunk.sc && (m == Block::none || is_water(m)))
+		Block e = n.get(p - iz);
+		if (n.has(p - iz) && (e == Block::none || is_water(e)))
 		{
-			Block e = m.block;
-			update_block(m, b.block);
-			update_block(b, e);
+			n.set(p - iz, b);
+			n.set(p, e);
 		}
 	}
 	else if (b == Block::water_source)
 	{
-		BlockRef m(pos - iz);
-		if (!m.chunk.sc) return;
-		if (m == Block::none || is_water_partial(m))
+		if (!n.has(p - iz)) return;
+		Block e = n.get(p - iz);
+		if (e == Block::none || is_water_partial(e))
 		{
-			int w = water_level(m);
-			update_block(m, Block(int(Block::water1) + w));
+			n.set(p - iz, Block(int(Block::water1) + water_level(e)));
 		}
 	}
 	else if (b == Block::water_drain)
 	{
-		BlockRef m(pos + iz);
-		if (m.chunk.sc && is_water(m))
+		Block e = n.get(p + iz);
+		if (n.has(p + iz) && is_water(e))
 		{
-			int w = water_level(m);
-			update_block(m, (w == 1) ? Block::none : Block(int(Block::water1) + w - 2));
+			int w = water_level(e);
+			n.set(p + iz, (w == 1) ? Block::none : Block(int(Block::water1) + w - 2));
 		}
 	}
 	else if (b == Block::soul_sand)
@@ -518,20 +645,18 @@ void model_simulate_block(glm::ivec3 pos)
 		bool active = false;
 		for (auto v : { -ix, ix, -iy, iy, -iz, iz })
 		{
-			BlockRef q(pos + v);
-			if (q.chunk.sc && is_water(q)) { update_block(q, Block::soul_sand); active = true; }
+			if (n.has(p + v) && is_water(n.get(p + v))) { n.set(p + v, Block::soul_sand); active = true; }
 		}
-		if (!active && rand() % 10 == 0)
+		if (!active && g_sim_random.next(10) == 0)
 		{
-			update_block(b, Block::none);
+			n.set(p, Block::none);
 		}
 		else
 		{
-			b.chunk.activate();
+			n.activate_center();
 		}
 	}
 }
-
 BitSet<ChunkSizeBits> sim_visited_set;
 BitSet<ChunkSizeBits> sim_visited_local;
 std::vector<glm::ivec3> sim_visited_list;
@@ -620,39 +745,108 @@ void model_simulate_gravity()
 	}
 }
 
-void server_simulate_blocks()
+// Sends blocks changed during this tick to every client which has their chunk
+void server_send_block_updates()
 {
-	sim_active_chunks.clear();
+	for (glm::ivec3 cpos : g_dirty_chunks)
+	{
+		Chunk chunk = g_scm.get(cpos);
+		if (!chunk.sc || !chunk.sc->dirty[chunk.icpos]) continue;
+		chunk.sc->dirty.clear(chunk.icpos);
+
+		std::vector<uint16_t>& changes = chunk.sc->changes[SuperChunk::chunk_index(chunk.icpos)];
+		std::sort(changes.begin(), changes.end());
+		changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+		for (Connection* conn : g_connections)
+		{
+			if (conn->m_chunks[cpos & MapSizeMask] == cpos && glm::distance2(conn->m_cpos, cpos) <= sqr(RenderDistance))
+			{
+				conn->send_block_updates(cpos, chunk.blocks(), changes);
+			}
+		}
+		changes.clear();
+	}
+	g_dirty_chunks.clear();
+}
+
+struct SimCandidate
+{
+	glm::ivec3 cpos;
+	int priority; // lower is first
+};
+
+std::vector<SimCandidate> sim_candidates;
+BitSet<SuperChunkSizeBits> sim_candidate_set;
+
+// Collects active chunks around all players, each only once, and orders them by distance to the nearest player.
+// Chunks that had to wait get closer to the front with every tick, so far chunks are never starved.
+void schedule_active_chunks()
+{
+	sim_candidates.clear();
+	sim_candidate_set.clear();
+	// simulation_sphere is sorted by distance, so every chunk is first found from its nearest player
 	for (glm::ivec3 d : simulation_sphere)
 	{
 		for (Connection* conn : g_connections)
 		{
 			glm::ivec3 cpos = conn->m_cpos + d;
 			Chunk chunk = g_scm.get(cpos);
-			if (!chunk.sc || !chunk.is_active()) continue;
-			chunk.deactivate();
-			sim_active_chunks.push_back(cpos);
-			if (sim_active_chunks.size() == MaxActiveChunks) goto exit_loop;
+			if (!chunk.sc || !chunk.is_active() || !sim_candidate_set.xset(cpos)) continue;
+			SimCandidate c;
+			c.cpos = cpos;
+			c.priority = sqr(d) - SimulationAging * chunk.waiting();
+			sim_candidates.push_back(c);
 		}
 	}
-	exit_loop:;
+	std::sort(sim_candidates.begin(), sim_candidates.end(), [](const SimCandidate& a, const SimCandidate& b) { return a.priority < b.priority; });
+}
+
+void server_simulate_blocks()
+{
+	Timestamp t0;
+	schedule_active_chunks();
 
 	// shuffle sim_order
-	if (sim_active_chunks.size() > 0) FOR(i, ChunkSize2 / 4)
+	if (sim_candidates.size() > 0) FOR(i, ChunkSize2 / 4)
 	{
-		std::swap(sim_order[rand() % ChunkSize2], sim_order[rand() % ChunkSize2]);
+		std::swap(sim_order[g_sim_random.next(ChunkSize2)], sim_order[g_sim_random.next(ChunkSize2)]);
 	}
 
-	for (glm::ivec3 cpos : sim_active_chunks)
+	Timestamp ta;
+	sim_active_chunks.clear();
+	uint i = 0;
+	while (i < sim_candidates.size() && (g_simulation_limit > 0 ? i < g_simulation_limit : (i == 0 || g_simulation_budget_ms == 0 || ta.elapsed_ms() < g_simulation_budget_ms)))
 	{
+		glm::ivec3 cpos = sim_candidates[i++].cpos;
 		Chunk chunk = g_scm.get(cpos);
+		chunk.deactivate();
+		chunk.waiting() = 0;
+		sim_active_chunks.push_back(cpos);
+		ChunkNeighborhood n;
+		n.init(cpos);
 		FOR(z, ChunkSize) for (glm::i8vec2 xy : sim_order)
 		{
-			model_simulate_block(glm::ivec3(xy.x, xy.y, z) + (cpos << ChunkSizeBits));
+			model_simulate_block(n, glm::ivec3(xy.x, xy.y, z));
 		}
 	}
+	sim_backlog = sim_candidates.size() - i;
+	if (sim_backlog > 0) record("sim %u", i);
+	for (; i < sim_candidates.size(); i++)
+	{
+		uint16_t& waiting = g_scm.get(sim_candidates[i].cpos).waiting();
+		if (waiting < 0xFFFF) waiting += 1;
+	}
 
+	Timestamp tb;
 	model_simulate_gravity();
+	Timestamp tc;
+	server_send_block_updates();
+	Timestamp td;
+
+	sim_schedule_ms = t0.elapsed_ms(ta);
+	sim_blocks_ms = ta.elapsed_ms(tb);
+	sim_gravity_ms = tb.elapsed_ms(tc);
+	sim_updates_ms = tc.elapsed_ms(td);
 }
 
 // =============
@@ -681,7 +875,7 @@ void server_edit_block(glm::ivec3 pos, Block block)
 		// ISSUE: if distance is >40, but still inside Map then client will skip update to chunk
 		// TODO: ensure robust synchnorization of chunks between client and server.
 		//       client can only change its local Map origin (cpos) when it gets ack from server for its position update.
-		if (glm::distance2(conn->m_cpos, cpos) <= sqr(40/*RenderDistance*/))
+		if (glm::distance2(conn->m_cpos, cpos) <= sqr(RenderDistance))
 		{
 			conn->send_chunk(cpos, chunk);
 		}
@@ -714,6 +908,7 @@ void server_receive_text_message(Connection& conn, const char* message, uint len
 		glm::ivec3 pos(parse_int(tokens[1]), parse_int(tokens[2]), parse_int(tokens[3]));
 		int block = parse_int(tokens[4]);
 		if (block < 0 || block >= block_count) return;
+		record("block %d %d %d %d", pos.x, pos.y, pos.z, block);
 		server_edit_block(pos, (Block)block);
 		return;
 	}
@@ -725,6 +920,18 @@ void server_receive_text_message(Connection& conn, const char* message, uint len
 		return;
 	}
 
+	if (tokens[0] == "noise")
+	{
+		// noise ground|clouds exact|lattice (only affects chunks generated from now on)
+		extern std::atomic<bool> g_exact_ground_noise, g_exact_cloud_noise;
+		if (tokens.size() < 3) return;
+		std::atomic<bool>* exact = (tokens[1] == "ground") ? &g_exact_ground_noise : (tokens[1] == "clouds") ? &g_exact_cloud_noise : nullptr;
+		if (!exact) return;
+		if (tokens[2] == "exact") exact->store(true, std::memory_order_relaxed);
+		if (tokens[2] == "lattice") exact->store(false, std::memory_order_relaxed);
+		return;
+	}
+
 	if (tokens[0] == "fsync")
 	{
 		g_scm.save(); // blocking operation!
@@ -758,6 +965,7 @@ bool server_receive_message(Connection& conn)
 		return true;
 	}
 	case MessageType::ChunkState: FAIL;
+	case MessageType::BlockUpdates: FAIL;
 	}
 	return false;
 }
@@ -768,10 +976,20 @@ float simulation_time_ms = 0;
 float chunk_time_ms = 0;
 float avatar_time_ms = 0;
 
-void server_main()
+void server_main(const char* record_path)
 {
 	FOR(i, 255) g_free_ids.push_back(254 - i);
 
+	uint64_t seed = rdtsc();
+	g_sim_random.seed(seed);
+	if (record_path)
+	{
+		g_record = fopen(record_path, "w");
+		CHECK2(g_record, exit(1));
+		fprintf(g_record, "seed %llu\n", (unsigned long long)seed);
+		fprintf(g_record, "budget %g\n", g_simulation_budget_ms);
+	}
+
 	Socket server_sock;
 	CHECK2(server_sock.bind(7000), exit(1));
 	fprintf(stderr, "Server running on port 7000\n");
@@ -802,6 +1020,7 @@ void server_main()
 			conn->avatar.id = create_id();
 			conn->avatar.broadcasted = true;
 			fprintf(stderr, "Player #%d connected from %s\n", conn->avatar.id, conn->host);
+			record("join %d", conn->avatar.id);
 			// TODO: send to new player positions of all other avatars (as they may be standing still)
 			for (Connection* conn2 : g_connections)
 			{
@@ -819,6 +1038,7 @@ void server_main()
 			if (!conn->exchange())
 			{
 				fprintf(stderr, "Player #%d disconnected from %s\n", conn->avatar.id, conn->host);
+				record("left %d", conn->avatar.id);
 				for (Connection* conn2 : g_connections)
 				{
 					if (conn != conn2) write_text_message(conn->send_buffer, "left #%d", conn->avatar.id);
@@ -849,17 +1069,20 @@ void server_main()
 		for (Connection* conn : g_connections)
 		{
 			Timestamp ta;
+			uint scaned = 0;
 			while (conn->m_scaned_chunks < g_server_render_sphere.size())
 			{
 				glm::ivec3 cpos = conn->m_cpos + g_server_render_sphere[conn->m_scaned_chunks];
-				if (conn->m_chunks[cpos & MapSizeBits] != cpos)
+				if (conn->m_chunks[cpos & MapSizeMask] != cpos)
 				{
 					Blocks& chunk = *g_scm.acquire_chunk(cpos, true); // TODO: use chunk_gen_budget // TODO: release?
 					conn->send_chunk(cpos, chunk);
 				}
 				conn->m_scaned_chunks += 1;
+				scaned += 1;
 				if (ta.elapsed_ms() > 10) break;
 			}
+			if (scaned > 0) record("load %d %u", conn->avatar.id, scaned);
 		}
 
 		// broadcast avatar states
@@ -892,8 +1115,11 @@ void server_main()
 		mss.simulation_time = simulation_time_ms * 10;
 		mss.chunk_time = chunk_time_ms * 10;
 		mss.avatar_time = avatar_time_ms * 10;
+		mss.simulation_backlog = std::min<uint>(sim_backlog, 0xFFFF);
 		mss.frame += 1;
 		for (Connection* conn : g_connections) conn->send_buffer.write(mss);
+		g_server_frame += 1;
+		if (g_record) fflush(g_record);
 
 		Timestamp tx;
 		double ft = ta.elapsed_ms(tx);
@@ -901,3 +1127,208 @@ void server_main()
 		ta = tx;
 	}
 }
+
+// =============
+
+// chunks to load per avatar in the current tick (from load events)
+uint replay_load[256];
+
+bool replay_event(const char* type, const char* args, Connection** avatars)
+{
+	int id;
+	uint count;
+	glm::ivec3 p;
+	if (strcmp(type, "join") == 0)
+	{
+		CHECK(sscanf(args, "%d", &id) == 1 && 0 <= id && id < 256 && !avatars[id]);
+		Connection* conn = new Connection;
+		conn->avatar.id = id;
+		avatars[id] = conn;
+		g_connections.push_back(conn);
+		return true;
+	}
+	if (strcmp(type, "left") == 0)
+	{
+		CHECK(sscanf(args, "%d", &id) == 1 && 0 <= id && id < 256 && avatars[id]);
+		auto it = std::find(g_connections.begin(), g_connections.end(), avatars[id]);
+		*it = g_connections.back();
+		g_connections.pop_back();
+		delete avatars[id];
+		avatars[id] = nullptr;
+		return true;
+	}
+	if (strcmp(type, "cpos") == 0)
+	{
+		CHECK(sscanf(args, "%d %d %d %d", &id, &p.x, &p.y, &p.z) == 4 && 0 <= id && id < 256 && avatars[id]);
+		avatars[id]->set_cpos(p);
+		return true;
+	}
+	if (strcmp(type, "block") == 0)
+	{
+		uint block;
+		CHECK(sscanf(args, "%d %d %d %u", &p.x, &p.y, &p.z, &block) == 4 && block < block_count);
+		server_edit_block(p, (Block)block);
+		return true;
+	}
+	if (strcmp(type, "sim") == 0)
+	{
+		CHECK(sscanf(args, "%u", &count) == 1 && count > 0);
+		g_simulation_limit = count;
+		return true;
+	}
+	if (strcmp(type, "load") == 0)
+	{
+		CHECK(sscanf(args, "%d %u", &id, &count) == 2 && 0 <= id && id < 256 && avatars[id]);
+		replay_load[id] = count;
+		return true;
+	}
+	fprintf(stderr, "Unknown event [%s]\n", type);
+	return false;
+}
+
+// Replays recording made with --record against the world in g_world_dir, without network.
+// Instead of the time budget, each tick simulates the number of chunks that the live server managed to simulate,
+// and loads the chunks that the live server loaded, so that every run does exactly the same work as the recorded one.
+// Prints time spent in simulation phases and hash of the resulting world.
+bool server_replay(const char* recording, uint ticks)
+{
+	FILE* file = fopen(recording, "r");
+	CHECK(file);
+	Auto(fclose(file));
+
+	unsigned long long seed;
+	float budget_ms;
+	CHECK(fscanf(file, "seed %llu\n", &seed) == 1);
+	CHECK(fscanf(file, "budget %f\n", &budget_ms) == 1);
+	g_sim_random.seed(seed);
+	g_simulation_budget_ms = 0;
+	printf("recorded with %g ms simulation budget per tick, replaying recorded chunk counts\n", budget_ms);
+
+	Connection* avatars[256] = {};
+
+	const char* phase_name[] = { "load", "schedule", "blocks", "gravity", "updates" };
+	double phase_ms[5] = {}, phase_max_ms[5] = {};
+	uint64_t simulated_chunks = 0;
+
+	char line[256];
+	bool has_line = fgets(line, sizeof(line), file) != nullptr;
+	Timestamp t0;
+	for (uint tick = 0; tick < ticks; tick++)
+	{
+		g_simulation_limit = 0;
+		for (uint& count : replay_load) count = 0;
+		while (has_line)
+		{
+			uint frame;
+			char type[16];
+			int n;
+			CHECK(sscanf(line, "%u %15s %n", &frame, type, &n) == 2);
+			if (frame > tick) break;
+			if (!replay_event(type, line + n, avatars)) return false;
+			has_line = fgets(line, sizeof(line), file) != nullptr;
+		}
+
+		server_simulate_blocks();
+		simulated_chunks += sim_active_chunks.size();
+
+		// same order as in server_main: chunks are loaded after simulation
+		Timestamp ta;
+		for (Connection* conn : g_connections)
+		{
+			uint end = std::min<uint>(conn->m_scaned_chunks + replay_load[conn->avatar.id], g_server_render_sphere.size());
+			for (; conn->m_scaned_chunks < end; conn->m_scaned_chunks++)
+			{
+				glm::ivec3 cpos = conn->m_cpos + g_server_render_sphere[conn->m_scaned_chunks];
+				if (conn->m_chunks[cpos & MapSizeMask] != cpos) conn->send_chunk(cpos, *g_scm.acquire_chunk(cpos, true));
+			}
+		}
+		Timestamp tb;
+		for (Connection* conn : g_connections) conn->send_buffer.read_message(conn->send_buffer.size());
+
+		double ms[5] = { ta.elapsed_ms(tb), sim_schedule_ms, sim_blocks_ms, sim_gravity_ms, sim_updates_ms };
+		FOR(i, 5)
+		{
+			phase_ms[i] += ms[i];
+			phase_max_ms[i] = std::max(phase_max_ms[i], ms[i]);
+		}
+		g_server_frame += 1;
+	}
+	double total_ms = t0.elapsed_ms();
+
+	printf("ticks %u, simulated chunks %llu, total %.1f ms\n", ticks, (unsigned long long)simulated_chunks, total_ms);
+	FOR(i, 5)
+	{
+		printf("%-8s total %9.1f ms  mean %7.3f ms  max %7.3f ms\n", phase_name[i], phase_ms[i], phase_ms[i] / std::max(1u, ticks), phase_max_ms[i]);
+	}
+	printf("world hash %016llx\n", (unsigned long long)g_scm.hash());
+	return true;
+}
+
+// Generates all unexplored chunks within radius (in chunks) of center chunk and saves them to g_world_dir,
+// so that players don't have to wait for generation. One super chunk at a time is loaded,
+// its missing chunks are generated by all threads, then it is saved and unloaded.
+bool server_pregen(glm::ivec3 center, int radius, uint threads)
+{
+	threads = std::max(1u, threads);
+
+	// chunks grouped by super chunk
+	std::vector<glm::ivec3> list;
+	FOR2(x, -radius, radius) FOR2(y, -radius, radius) FOR2(z, -radius, radius)
+	{
+		glm::ivec3 d(x, y, z);
+		if (sqr(d) <= radius * radius) list.push_back(center + d);
+	}
+	std::sort(list.begin(), list.end(), [](glm::ivec3 a, glm::ivec3 b) {
+		glm::ivec3 sa = a >> SuperChunkSizeBits, sb = b >> SuperChunkSizeBits;
+		if (sa.x != sb.x) return sa.x < sb.x;
+		if (sa.y != sb.y) return sa.y < sb.y;
+		if (sa.z != sb.z) return sa.z < sb.z;
+		return SuperChunk::chunk_index(a & SuperChunkSizeMask) < SuperChunk::chunk_index(b & SuperChunkSizeMask); });
+	printf("pregen %zu chunks within radius %d of [%d %d %d], %u threads\n", list.size(), radius, center.x, center.y, center.z, threads);
+
+	size_t generated = 0, skipped = 0, super_chunks = 0;
+	Timestamp t0;
+	for (size_t begin = 0, end; begin < list.size(); begin = end)
+	{
+		glm::ivec3 scpos = list[begin] >> SuperChunkSizeBits;
+		for (end = begin + 1; end < list.size() && (list[end] >> SuperChunkSizeBits) == scpos; end++);
+
+		SuperChunk* sc = g_scm.acquire_super_chunk(scpos);
+		std::vector<glm::ivec3> missing;
+		for (size_t i = begin; i < end; i++)
+		{
+			if (!sc->explored()[list[i] & SuperChunkSizeMask]) missing.push_back(list[i]);
+		}
+		skipped += end - begin - missing.size();
+
+		std::atomic<uint> next(0);
+		auto worker = [&]() {
+			for (uint i = next++; i < missing.size(); i = next++)
+			{
+				generate_chunk(sc->chunk(missing[i] & SuperChunkSizeMask), missing[i]);
+			}
+		};
+		std::vector<std::thread> pool;
+		size_t workers = std::min<size_t>(threads, missing.size());
+		for (size_t i = 1; i < workers; i++) pool.push_back(std::thread(worker));
+		worker();
+		for (std::thread& t : pool) t.join();
+
+		for (glm::ivec3 cpos : missing) sc->explored().set(cpos & SuperChunkSizeMask);
+		if (!missing.empty()) sc->modified = true;
+		generated += missing.size();
+		super_chunks += 1;
+		if (!g_scm.release_super_chunk(scpos))
+		{
+			fprintf(stderr, "pregen failed: super chunk [%d %d %d] wasn't saved\n", scpos.x, scpos.y, scpos.z);
+			return false;
+		}
+
+		double s = t0.elapsed_ms() / 1000;
+		printf("%5.1f%%  generated %zu  skipped %zu  super chunks %zu  %.0f chunks/s\n", (generated + skipped) * 100.0 / list.size(), generated, skipped, super_chunks, generated / std::max(s, 1e-3));
+		fflush(stdout);
+	}
+	double s = t0.elapsed_ms() / 1000;
+	printf("done in %.1f s: generated %zu chunks (%.0f chunks/s), %zu already explored\n", s, generated, generated / std::max(s, 1e-3), skipped);
+	return true;
+}
@@ -0,0 +1,154 @@
+#version 150
+
+// Vertex pulling: six vertices per PackedQuad (see main.cc), quad is gl_VertexID / 6 in quads buffer.
+// Same output as block.vert + block.geom, so it is used with block.frag.
+// One draw call covers many chunks: chunk origin is found through page of quad (QuadPage quads) -> arena handle -> origin.
+
+uniform int tick;
+uniform vec3 eye;
+uniform mat4 matrix;
+uniform usamplerBuffer quads;
+uniform usamplerBuffer pages;
+uniform isamplerBuffer origins;
+
+out float fog_factor;
+out float fragment_light;
+out vec2 fragment_uv;
+out float fragment_texture;
+out float fragment_underwater_texture;
+
+uniform float foglimit2;
+
+const float pi = 3.14159265f;
+
+// Cube::faces
+const int faces[24] = int[24](0, 4, 6, 2, 1, 3, 7, 5, 0, 1, 5, 4, 2, 6, 7, 3, 0, 2, 3, 1, 4, 5, 7, 6);
+
+// triangle strip of geometry shader as two triangles
+const int strip[6] = int[6](0, 1, 2, 2, 1, 3);
+
+const int QuadPage = 16;
+
+vec3 leaf_transform(vec3 p)
+{
+	// TODO All of these should be moved to uniform vars
+	float ftick = tick * 0.4;
+	float speed = 0.75;
+	float magnitude = (sin((ftick * pi / ((28.0) * speed))) * 0.05 + 0.15)*0.2;
+	float d0 = sin(ftick * pi / (122.0 * speed)) * 3.0 - 1.5;
+	float d1 = sin(ftick * pi / (142.0 * speed)) * 3.0 - 1.5;
+	float d2 = sin(ftick * pi / (162.0 * speed)) * 3.0 - 1.5;
+	float d3 = sin(ftick * pi / (112.0 * speed)) * 3.0 - 1.5;
+
+	p.x += sin((ftick * pi / (13.0 * speed)) + (p.x + d0)*0.9 + (p.z + d1)*0.9) * magnitude;
+	p.z += sin((ftick * pi / (16.0 * speed)) + (p.z + d2)*0.9 + (p.x + d3)*0.9) * magnitude;
+	return p;
+}
+
+int get_light(int light, int i)
+{
+	int s = (i % 4) * 4;
+	int a = (light >> s) & 15;
+	return (a + 1) * 16 - 1;
+}
+
+int transform_texture(int block_texture)
+{
+	if (block_texture == 6 || block_texture == 38) // lava_flow / lava_still
+	{
+		return block_texture + ((tick / 8) % 32);
+	}
+	if (block_texture == 70) // water_still
+	{
+		return block_texture + ((tick / 8) % 64);
+	}
+	if (block_texture == 134) // pumpkin_face
+	{
+		return block_texture + ((tick / 40) % 2);
+	}
+	if (block_texture == 136) // furnace_front_on
+	{
+		return block_texture + ((tick / 10) % 16);
+	}
+	if (block_texture == 152) // sea_lantern
+	{
+		return block_texture + ((tick / 20) % 5);
+	}
+	if (block_texture == 157 || block_texture == 159) // redstone_lamp
+	{
+		return block_texture + ((tick / 40) % 2);
+	}
+	if (block_texture == 161) // water_flow
+	{
+		return block_texture + ((tick / 8) % 32);
+	}
+	return block_texture;
+}
+
+void main()
+{
+	int quad = gl_VertexID / 6;
+	uvec2 q = texelFetch(quads, quad).rg;
+	uint handle = texelFetch(pages, quad / QuadPage).r;
+	ivec3 cpos = texelFetch(origins, int(handle)).xyz;
+	int light = int(q.x & 0xFFFFu);
+	int block_texture = int((q.x >> 16) & 0x3FFu);
+	bool underwater = ((q.x >> 26) & 1u) != 0u;
+	int face = int(q.x >> 27);
+
+	// Compute texture
+	fragment_underwater_texture = underwater ? 70 + ((tick / 8) % 64) : -1.f;
+	fragment_texture = transform_texture(block_texture);
+
+	// Quad corners
+	int axis = face / 2;
+	ivec3 lo = ivec3(int(q.y & 31u) * 15, int((q.y >> 5) & 31u) * 15, int((q.y >> 10) & 255u));
+	ivec3 ext = ivec3(0);
+	ext[(axis == 0) ? 1 : 0] = (int((q.y >> 18) & 15u) + 1) * 15;
+	ext[(axis == 2) ? 1 : 2] = int((q.y >> 22) & 255u);
+	ivec3 vertex[4];
+	for (int i = 0; i < 4; i++)
+	{
+		int c = faces[face * 4 + i];
+		vertex[i] = lo + ivec3(c & 1, (c >> 1) & 1, (c >> 2) & 1) * ext;
+	}
+
+	ivec3 d = vertex[2] - vertex[0];
+	int u, v;
+	if (face < 2) { u = d.y; v = d.z; }
+	else if (face < 4) { u = d.x; v = d.z; }
+	else { u = d.y; v = d.x; }
+
+	// How much to rotate the quad?
+	int a = (face == 0 || face == 3 || face == 5) ? 0 : 1;
+
+	// Corner of strip (as emitted by block.geom)
+	int s = strip[gl_VertexID % 6];
+	int k;
+	ivec2 uv;
+	if (get_light(light, 1+a) != get_light(light, 3+a))
+	{
+		if (s == 0) { k = 3; uv = ivec2(0, v); }
+		else if (s == 1) { k = 0; uv = ivec2(u, v); }
+		else if (s == 2) { k = 2; uv = ivec2(0, 0); }
+		else { k = 1; uv = ivec2(u, 0); }
+	}
+	else
+	{
+		if (s == 0) { k = 0; uv = ivec2(u, v); }
+		else if (s == 1) { k = 1; uv = ivec2(u, 0); }
+		else if (s == 2) { k = 3; uv = ivec2(0, v); }
+		else { k = 2; uv = ivec2(0, 0); }
+	}
+
+	vec3 p = cpos + vertex[(k + a) % 4] / 15.0f;
+	if (block_texture <= 5) p = leaf_transform(p);
+
+	gl_Position = matrix * vec4(p, 1);
+	fragment_uv = uv / 15.0f;
+	fragment_light = (get_light(light, k + a) + 1) / 256.0f;
+
+	float eye_dist_sqr = dot(eye - p, eye - p);
+	fog_factor = clamp(eye_dist_sqr / foglimit2, 0.0, 1.0);
+	fog_factor *= fog_factor;
+}
@@ -0,0 +1,22 @@
+#include "util.hh"
+
+// Replays a simulation recording (made with: arena --server --record <file>) and reports time spent in each phase.
+
+extern const char* g_world_dir;
+bool server_replay(const char* recording, uint ticks);
+
+int main(int argc, char** argv)
+{
+	void sigsegv_handler(int sig);
+	signal(SIGSEGV, sigsegv_handler);
+
+	if (argc < 3 || argc > 4)
+	{
+		printf("usage: %s <recording> <ticks> [world dir]\n", argv[0]);
+		return 0;
+	}
+	if (argc == 4) g_world_dir = argv[3];
+
+	Timestamp::calibrate();
+	return server_replay(argv[1], atoi(argv[2])) ? 0 : 1;
+}
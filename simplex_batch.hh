@@ -0,0 +1,108 @@
+// No include guard: util.cc includes this twice, once for SSE and once inside AVX2 target region.
+// Requires util.hh and float vector typedefs.
+
+// Batch simplex noise: same operations in the same order as glm::simplex(vec3), on vectors of points.
+// Matches glm exactly, as long as the compiler doesn't contract multiply-adds (which it doesn't with default flags).
+// helpers are always inlined, so vectors are never passed across a real function call
+#define always_inline inline __attribute__((always_inline))
+
+template<typename F, typename I>
+struct SimplexBatch
+{
+	// inputs are never -0.0 or out of int range, so truncation is enough
+	static always_inline F floor(F a) { F t = __builtin_convertvector(__builtin_convertvector(a, I), F); return t + __builtin_convertvector(t > a, F); }
+	static always_inline F select(I mask, F a, F b) { return (F)(((I)a & mask) | ((I)b & ~mask)); }
+	static always_inline F abs(F a) { return select(a >= 0, a, -a); }
+	static always_inline F step(F edge, F a) { return select(a < edge, F{} + 0.0f, F{} + 1.0f); }
+	static always_inline F mod289(F a) { return a - floor(a * 1.0f / 289.0f) * 289.0f; }
+	static always_inline F permute(F a) { return mod289(((a * 34.0f) + 1.0f) * a); }
+
+	static always_inline F simplex(F vx, F vy, F vz)
+	{
+		const float Cx = 1.0 / 6.0, Cy = 1.0 / 3.0;
+
+		// First corner
+		F s = vx * Cy + vy * Cy + vz * Cy;
+		F ix = floor(vx + s), iy = floor(vy + s), iz = floor(vz + s);
+		F t = ix * Cx + iy * Cx + iz * Cx;
+		F x0 = vx - ix + t, y0 = vy - iy + t, z0 = vz - iz + t;
+
+		// Other corners
+		F gx = step(y0, x0), gy = step(z0, y0), gz = step(x0, z0);
+		F lx = 1.0f - gx, ly = 1.0f - gy, lz = 1.0f - gz;
+		// min and max of 0 and 1 values
+		F i1x = gx * lz, i1y = gy * lx, i1z = gz * ly;
+		F i2x = gx + lz - i1x, i2y = gy + lx - i1y, i2z = gz + ly - i1z;
+
+		F x1 = x0 - i1x + Cx, y1 = y0 - i1y + Cx, z1 = z0 - i1z + Cx;
+		F x2 = x0 - i2x + Cy, y2 = y0 - i2y + Cy, z2 = z0 - i2z + Cy;
+		F x3 = x0 - 0.5f, y3 = y0 - 0.5f, z3 = z0 - 0.5f;
+
+		// Permutations
+		ix = mod289(ix);
+		iy = mod289(iy);
+		iz = mod289(iz);
+		F p[4];
+		p[0] = permute(permute(permute(iz + 0.0f) + iy + 0.0f) + ix + 0.0f);
+		p[1] = permute(permute(permute(iz + i1z) + iy + i1y) + ix + i1x);
+		p[2] = permute(permute(permute(iz + i2z) + iy + i2y) + ix + i2x);
+		p[3] = permute(permute(permute(iz + 1.0f) + iy + 1.0f) + ix + 1.0f);
+
+		// Gradients
+		const float n_ = 0.142857142857;
+		const float nsx = n_ * 2.0f - 0.0f, nsy = n_ * 0.5f - 1.0f, nsz = n_ * 1.0f - 0.0f;
+		F dx[4] = { x0, x1, x2, x3 }, dy[4] = { y0, y1, y2, y3 }, dz[4] = { z0, z1, z2, z3 };
+		F d[4];
+		FOR(k, 4)
+		{
+			F j = p[k] - 49.0f * floor(p[k] * nsz * nsz);
+			F x_ = floor(j * nsz);
+			F y_ = floor(j - 7.0f * x_);
+			F x = x_ * nsx + nsy;
+			F y = y_ * nsx + nsy;
+			F h = 1.0f - abs(x) - abs(y);
+			F sh = -step(h, F{} + 0.0f);
+			F ax = x + (floor(x) * 2.0f + 1.0f) * sh;
+			F ay = y + (floor(y) * 2.0f + 1.0f) * sh;
+
+			F norm = float(1.79284291400159) - float(0.85373472095314) * (ax * ax + ay * ay + h * h);
+			ax *= norm;
+			ay *= norm;
+			h *= norm;
+
+			F m = float(0.6) - (dx[k] * dx[k] + dy[k] * dy[k] + dz[k] * dz[k]);
+			m = select(m < 0.0f, F{} + 0.0f, m);
+			m = m * m;
+			d[k] = m * m * (ax * dx[k] + ay * dy[k] + h * dz[k]);
+		}
+		// dot of vec4 adds pairs first
+		return 42.0f * ((d[0] + d[1]) + (d[2] + d[3]));
+	}
+
+	static always_inline void noise(const float* px, const float* py, const float* pz, float* out, int count, int octaves, float freqf, float ampf, bool turbulent)
+	{
+		const int W = sizeof(F) / sizeof(float);
+		for (int i = 0; i + W <= count; i += W)
+		{
+			F x, y, z;
+			memcpy(&x, px + i, sizeof(F));
+			memcpy(&y, py + i, sizeof(F));
+			memcpy(&z, pz + i, sizeof(F));
+			float freq = 1.0f, amp = 1.0f, max = amp;
+			F total = simplex(x, y, z);
+			if (turbulent) total = abs(total);
+			FOR(j, octaves - 1)
+			{
+				freq *= freqf;
+				amp *= ampf;
+				max += amp;
+				F e = simplex(x * freq, y * freq, z * freq);
+				total += (turbulent ? abs(e) : e) * amp;
+			}
+			total /= max;
+			memcpy(out + i, &total, sizeof(F));
+		}
+	}
+};
+
+#undef always_inline
@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <chrono>
 
 float noise(glm::vec2 p, int octaves, float freqf, float ampf, bool turbulent)
 {
@@ -34,6 +35,75 @@ float noise(glm::vec3 p, int octaves, float freqf, float ampf, bool turbulent)
 	return total / max;
 }
 
+typedef float float4 __attribute__((vector_size(16)));
+typedef int int4 __attribute__((vector_size(16)));
+typedef float float8 __attribute__((vector_size(32)));
+typedef int int8 __attribute__((vector_size(32)));
+
+namespace simplex_sse
+{
+#include "simplex_batch.hh"
+}
+
+// AVX2 copy is compiled entirely for AVX2, so 256-bit vectors are never passed or returned by code without AVX
+// (noise_avx2 itself takes only pointers and scalars).
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+namespace simplex_avx2
+{
+#include "simplex_batch.hh"
+}
+
+static void noise_avx2(const float* x, const float* y, const float* z, float* out, int count, int octaves, float freqf, float ampf, bool turbulent)
+{
+	simplex_avx2::SimplexBatch<float8, int8>::noise(x, y, z, out, count, octaves, freqf, ampf, turbulent);
+}
+
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+void noise(const float* x, const float* y, const float* z, float* out, int count, int octaves, float freqf, float ampf, bool turbulent)
+{
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	int done = 0;
+	if (avx2)
+	{
+		noise_avx2(x, y, z, out, count, octaves, freqf, ampf, turbulent);
+		done = count & ~7;
+	}
+	simplex_sse::SimplexBatch<float4, int4>::noise(x + done, y + done, z + done, out + done, count - done, octaves, freqf, ampf, turbulent);
+	done += (count - done) & ~3;
+	for (int i = done; i < count; i++) out[i] = noise(glm::vec3(x[i], y[i], z[i]), octaves, freqf, ampf, turbulent);
+}
+
+// ==============
+
+double Timestamp::milisec_per_tick = 0;
+
+void Timestamp::calibrate()
+{
+	auto seconds = []() { return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count(); };
+	glm::dvec3 a, c;
+	glm::i64vec3 b, d;
+	FOR(i, 3)
+	{
+		a[i] = seconds();
+		b[i] = rdtsc();
+		usleep(50000);
+		c[i] = seconds();
+		d[i] = rdtsc();
+	}
+	init(a, b, c, d);
+}
+
 // ==============
 
 void sigsegv_handler(int sig)
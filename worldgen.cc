@@ -1,23 +1,8 @@
 #include "block.hh"
 #include "algorithm.hh"
-
-struct Heightmap
-{
-	int height[ChunkSize * MapSize][ChunkSize * MapSize];
-	uint8_t treeType[ChunkSize * MapSize][ChunkSize * MapSize];
-	Block color[ChunkSize * MapSize][ChunkSize * MapSize];
-	glm::ivec2 last[MapSize][MapSize];
-
-	Heightmap()
-	{
-		FOR(x, ChunkSize) FOR(y, ChunkSize) last[x][y] = glm::ivec2(1000000, 1000000);
-	}
-
-	void Populate(int cx, int cy);
-	int& Height(int x, int y) { return height[x & (ChunkSize * MapSize - 1)][y & (ChunkSize * MapSize - 1)]; }
-	uint8_t& TreeType(int x, int y) { return treeType[x & (ChunkSize * MapSize - 1)][y & (ChunkSize * MapSize - 1)]; }
-	Block& Color(int x, int y) { return color[x & (ChunkSize * MapSize - 1)][y & (ChunkSize * MapSize - 1)]; }
-};
+#include <memory>
+#include <mutex>
+#include <list>
 
 int GetHeight(int x, int y)
 {
@@ -40,73 +25,263 @@ float Tree(int x, int y)
 
 uint8_t GetTreeType(int x, int y)
 {
-	float a = Tree(x, y);
-	FOR2(xx, -1, 1) FOR2(yy, -1, 1)
-	{
-		if ((xx != 0 || yy != 0) && a <= Tree(x + xx, y + yy))
-			return 0;
-	}
 	return 1 + (uint)(noise(glm::vec2(x, y) * 0.245f, 1.0f, 0.5f, 0.5f, true) * 60) % 6;
 }
 
-void Heightmap::Populate(int cx, int cy)
+// Tree is a strict local maximum of Tree(x, y) over its 8 neighbors.
+// Trunk is from height+1 to height+5, leaves are in 4 neighbor columns from height+3 to height+5.
+struct TreeSpot
 {
-	if (last[cx & MapSizeMask][cy & MapSizeMask] != glm::ivec2(cx, cy))
+	int8_t x, y; // local to tile, from -1 to ChunkSize (leaves of border trees reach into tile)
+	int16_t height;
+	Block trunk, leaves;
+};
+
+// Heightmap of 16x16 columns (one chunk column), with a border of one column for trees next to it.
+// Immutable once computed, so it can be shared by generator threads.
+struct ColumnTile
+{
+	static const int Size = ChunkSize + 2;
+
+	int16_t m_height[Size][Size];
+	Block m_color[ChunkSize][ChunkSize]; // no border
+	int16_t m_tree_top[ChunkSize][ChunkSize]; // highest trunk or leaves block in column
+	std::vector<TreeSpot> trees;
+
+	// over inner columns
+	int min_height, max_height;
+	int top; // highest non-air block (ground or tree)
+
+	// local coordinates, from -1 to ChunkSize
+	int height(int x, int y) const { return m_height[y + 1][x + 1]; }
+	// local coordinates, from 0 to ChunkSize-1
+	Block color(int x, int y) const { return m_color[y][x]; }
+	int tree_top(int x, int y) const { return m_tree_top[y][x]; }
+
+	void init(glm::ivec2 tpos)
 	{
-		FOR(x, ChunkSize) FOR(y, ChunkSize)
+		glm::ivec2 base = tpos * ChunkSize;
+		FOR2(y, -1, ChunkSize) FOR2(x, -1, ChunkSize)
+		{
+			m_height[y + 1][x + 1] = GetHeight(base.x + x, base.y + y);
+		}
+		min_height = std::numeric_limits<int>::max();
+		max_height = std::numeric_limits<int>::min();
+		FOR(y, ChunkSize) FOR(x, ChunkSize)
 		{
-			Height(x + cx * ChunkSize, y + cy * ChunkSize) = GetHeight(x + cx * ChunkSize, y + cy * ChunkSize);
-			TreeType(x + cx * ChunkSize, y + cy * ChunkSize) = GetTreeType(x + cx * ChunkSize, y + cy * ChunkSize);
-			Color(x + cx * ChunkSize, y + cy * ChunkSize) = GetColor(x + cx * ChunkSize, y + cy * ChunkSize);
+			m_color[y][x] = GetColor(base.x + x, base.y + y);
+			min_height = std::min(min_height, height(x, y));
+			max_height = std::max(max_height, height(x, y));
 		}
-		last[cx & MapSizeMask][cy & MapSizeMask] = glm::ivec2(cx, cy);
+		top = max_height;
+		init_trees(base);
 	}
-}
 
-static Heightmap* g_heightmap = new Heightmap;
+private:
+	void init_trees(glm::ivec2 base)
+	{
+		// tree noise with a border of two columns, so that maxima can be found for border columns
+		const int B = 2, S = ChunkSize + 2 * B;
+		float field[S][S];
+		FOR(y, S) FOR(x, S) field[y][x] = Tree(base.x + x - B, base.y + y - B);
 
-const int CraterRadius = 500;
-const glm::ivec3 CraterCenter(CraterRadius * -0.8, CraterRadius * -0.8, 0);
+		FOR(y, ChunkSize) FOR(x, ChunkSize) m_tree_top[y][x] = std::numeric_limits<int16_t>::min();
+		FOR2(y, -1, ChunkSize) FOR2(x, -1, ChunkSize)
+		{
+			float a = field[y + B][x + B];
+			bool maximum = true;
+			FOR2(yy, -1, 1) FOR2(xx, -1, 1)
+			{
+				if ((xx != 0 || yy != 0) && a <= field[y + yy + B][x + xx + B]) maximum = false;
+			}
+			if (!maximum) continue;
 
-const int MoonRadius = 500;
-const glm::ivec3 MoonCenter(MoonRadius * 0.8, MoonRadius * 0.8, 0);
+			uint8_t type = GetTreeType(base.x + x, base.y + y);
+			TreeSpot t;
+			t.x = x;
+			t.y = y;
+			t.height = height(x, y);
+			t.trunk = Block(uint(Block::log_acacia) + type - 1);
+			t.leaves = Block(uint(Block::leaves_acacia) + type - 1);
+			trees.push_back(t);
 
-Block generate_block(glm::ivec3 pos)
+			for (glm::ivec2 i : { glm::ivec2(0, 0), glm::ivec2(0, -1), glm::ivec2(0, 1), glm::ivec2(-1, 0), glm::ivec2(1, 0) })
+			{
+				glm::ivec2 p(x + i.x, y + i.y);
+				if (p.x < 0 || p.y < 0 || p.x >= ChunkSize || p.y >= ChunkSize) continue;
+				int16_t& tt = m_tree_top[p.y][p.x];
+				tt = std::max<int16_t>(tt, t.height + 5);
+				top = std::max<int>(top, tt);
+			}
+		}
+	}
+};
+
+// LRU cache of column tiles, split into independently locked shards.
+// Tiles are computed outside of the lock (two threads may compute the same tile, only one is kept).
+class ColumnCache
 {
-	// crater
-	if (pos.z < 100)
+public:
+	ColumnCache(uint capacity) : m_shard_capacity(std::max<uint>(1, capacity / Shards)) { }
+
+	std::shared_ptr<const ColumnTile> get(glm::ivec2 tpos)
 	{
-		int64_t sx = sqr<int64_t>(pos.x - CraterCenter.x) - sqr<int64_t>(CraterRadius);
-		if (sx <= 0)
+		glm::ivec3 key(tpos, 0);
+		Shard& shard = m_shards[(uint(tpos.x) * 73856093u ^ uint(tpos.y) * 19349663u) % Shards];
 		{
-			int64_t sy = sx + sqr<int64_t>(pos.y - CraterCenter.y);
-			if (sy <= 0)
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto* e = shard.map.find(key);
+			if (e)
 			{
-				int64_t sz = sy + sqr<int64_t>(pos.z - CraterCenter.z);
-				if (sz <= 0) return Block::none;
+				shard.lru.splice(shard.lru.begin(), shard.lru, *e);
+				return (*e)->tile;
 			}
 		}
+
+		std::shared_ptr<ColumnTile> tile(new ColumnTile);
+		tile->init(tpos);
+
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto* e = shard.map.find(key);
+		if (e) return (*e)->tile;
+		shard.lru.push_front(Item{ key, tile });
+		shard.map[key] = shard.lru.begin();
+		while (shard.lru.size() > m_shard_capacity)
+		{
+			shard.map.erase(shard.lru.back().key);
+			shard.lru.pop_back();
+		}
+		return tile;
 	}
 
-	// moon
-	int64_t sx = sqr<int64_t>(pos.x - MoonCenter.x) - sqr<int64_t>(MoonRadius);
-	if (sx <= 0)
+	void clear()
 	{
-		int64_t sy = sx + sqr<int64_t>(pos.y - MoonCenter.y);
-		if (sy <= 0)
+		for (Shard& shard : m_shards)
 		{
-			int64_t sz = sy + sqr<int64_t>(pos.z - MoonCenter.z);
-			if (sz <= 0)
-			{
-				double q = noise(glm::vec3(pos) * 0.03f, 4, 0.5f, 0.5f, false);
-				static Block ores[6] = { Block::gold_ore, Block::coal_ore, Block::diamond_ore, Block::redstone_ore, Block::emerald_ore, Block::lapis_ore};
-				if (q >= 0.6) return ores[uint(pos.x ^ pos.y ^ pos.z) / 3 % 6];
-				return Block::stone;
-			}
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.map.clear();
+			shard.lru.clear();
 		}
 	}
 
-	if (pos.x >= 0 && pos.x < 64 && pos.z == 3 && pos.y >= 0 && pos.y < 16 && (pos.x % 3) == 0 && (pos.y % 3) == 0)
+private:
+	static const uint Shards = 16;
+
+	struct Item
+	{
+		glm::ivec3 key;
+		std::shared_ptr<const ColumnTile> tile;
+	};
+
+	struct Shard
+	{
+		std::mutex mutex;
+		std::list<Item> lru; // most recent first
+		SpatialMap<std::list<Item>::iterator> map;
+	};
+
+	const uint m_shard_capacity;
+	Shard m_shards[Shards];
+};
+
+// enough for render distance of 40 chunks (about 10 MB)
+static ColumnCache g_column_cache(8192);
+
+// for benchmarks
+void clear_column_cache() { g_column_cache.clear(); }
+
+const int CraterRadius = 500;
+const glm::ivec3 CraterCenter(CraterRadius * -0.8, CraterRadius * -0.8, 0);
+
+const int MoonRadius = 500;
+const glm::ivec3 MoonCenter(MoonRadius * 0.8, MoonRadius * 0.8, 0);
+
+// Blocks which need 3d noise are decided in a second pass, after noise is evaluated for the whole chunk at once
+enum class NoiseRule : uint8_t { None, Moon, Ground, Cloud };
+
+const float GroundNoiseScale = 0.03f; // also moon
+const float CloudNoiseScale = 0.01f;
+
+// Both noise fields are low frequency, so by default they are sampled on a lattice of 4x4x4 points per chunk
+// (at local coordinates 0, 5, 10 and 15) and trilinearly interpolated. Exact evaluates noise at every block.
+// Toggled from the server thread ("noise" command) while generator threads run.
+std::atomic<bool> g_exact_ground_noise(false);
+std::atomic<bool> g_exact_cloud_noise(false);
+
+const int LatticeSize = 4;
+const int LatticeStep = (ChunkSize - 1) / (LatticeSize - 1);
+static_assert(LatticeStep * (LatticeSize - 1) == ChunkSize - 1, "");
+
+// lattice is indexed [z][y][x]
+float lattice_sample(const float* lattice, glm::ivec3 v)
+{
+	glm::ivec3 i = glm::min(v / LatticeStep, glm::ivec3(LatticeSize - 2));
+	glm::vec3 t = glm::vec3(v - i * LatticeStep) / float(LatticeStep);
+	const float* a = lattice + (i.z * LatticeSize + i.y) * LatticeSize + i.x;
+	const int Y = LatticeSize, Z = LatticeSize * LatticeSize;
+	float y0 = glm::mix(glm::mix(a[0], a[1], t.x), glm::mix(a[Y], a[Y + 1], t.x), t.y);
+	float y1 = glm::mix(glm::mix(a[Z], a[Z + 1], t.x), glm::mix(a[Z + Y], a[Z + Y + 1], t.x), t.y);
+	return glm::mix(y0, y1, t.z);
+}
+
+Block ore_block(glm::ivec3 pos)
+{
+	static Block ores[6] = { Block::gold_ore, Block::coal_ore, Block::diamond_ore, Block::redstone_ore, Block::emerald_ore, Block::lapis_ore};
+	return ores[uint(pos.x ^ pos.y ^ pos.z) / 3 % 6];
+}
+
+// Everything about a column of blocks which doesn't depend on z
+struct Column
+{
+	int height;
+	Block color;
+	int64_t crater, moon; // squared radius of sphere left for z (negative if column misses sphere)
+	int top; // all blocks above are air (except clouds)
+};
+
+const int CloudMin = 101, CloudMax = 199;
+
+int64_t isqrt(int64_t a)
+{
+	int64_t r = sqrt(double(a));
+	while (r * r > a) r -= 1;
+	while ((r + 1) * (r + 1) <= a) r += 1;
+	return r;
+}
+
+// x and y are local to tile, base is position of tile's first column
+Column generate_column(const ColumnTile& tile, int x, int y, glm::ivec2 base)
+{
+	Column c;
+	c.height = tile.height(x, y);
+	c.color = tile.color(x, y);
+	glm::ivec2 p = base + glm::ivec2(x, y);
+	c.crater = sqr<int64_t>(CraterRadius) - sqr<int64_t>(p.x - CraterCenter.x) - sqr<int64_t>(p.y - CraterCenter.y);
+	c.moon = sqr<int64_t>(MoonRadius) - sqr<int64_t>(p.x - MoonCenter.x) - sqr<int64_t>(p.y - MoonCenter.y);
+
+	c.top = std::max(c.height, 3/*showcase and water source*/);
+	c.top = std::max(c.top, tile.tree_top(x, y));
+	if (c.moon >= 0) c.top = std::max<int>(c.top, MoonCenter.z + isqrt(c.moon));
+	return c;
+}
+
+// Returns block at pos, or sets rule if the block depends on 3d noise at pos
+// tree is trunk or leaves stamped at pos (or Block::none)
+Block generate_block(glm::ivec3 pos, const Column& c, Block tree, NoiseRule& rule)
+{
+	rule = NoiseRule::None;
+
+	// crater
+	if (pos.z < 100 && sqr<int64_t>(pos.z - CraterCenter.z) <= c.crater) return Block::none;
+
+	// moon
+	if (sqr<int64_t>(pos.z - MoonCenter.z) <= c.moon)
+	{
+		rule = NoiseRule::Moon;
+		return Block::none;
+	}
+
+	if (pos.z == 3 && pos.x >= 0 && pos.x < 64 && pos.y >= 0 && pos.y < 16 && (pos.x % 3) == 0 && (pos.y % 3) == 0)
 	{
 		int i = (pos.x / 3) * 6 + pos.y / 3 + 1;
 		if (i < block_count && Block(i) != Block::water_source) return (Block)i;
@@ -117,52 +292,204 @@ Block generate_block(glm::ivec3 pos)
 		return Block::water_source;
 	}
 
-	// Tree
-	if (g_heightmap->TreeType(pos.x, pos.y))
+	if (tree != Block::none) return tree;
+
+	if (pos.z >= CloudMin && pos.z <= CloudMax)
 	{
-		int height = g_heightmap->Height(pos.x, pos.y);
-		if (pos.z > height && pos.z < height + 6) return Block(uint(Block::log_acacia) + g_heightmap->TreeType(pos.x, pos.y) - 1);
+		rule = NoiseRule::Cloud;
 	}
-	else for(glm::ivec2 i : { glm::ivec2(0, -1), glm::ivec2(0, 1), glm::ivec2(-1, 0), glm::ivec2(1, 0) })
+	else if (pos.z <= c.height)
 	{
-		if (g_heightmap->TreeType(pos.x + i.x, pos.y + i.y))
-		{
-			int height = g_heightmap->Height(pos.x + i.x, pos.y + i.y);
-			if (pos.z > height + 2 && pos.z < height + 6) return Block(uint(Block::leaves_acacia) + g_heightmap->TreeType(pos.x + i.x, pos.y + i.y) - 1);
-			break;
-		}
+		rule = NoiseRule::Ground;
 	}
 
-	if (pos.z > 100 && pos.z < 200)
+	return Block::none;
+}
+
+// q is noise at pos scaled by the rule's scale
+Block generate_block(glm::ivec3 pos, const Column& c, NoiseRule rule, double q)
+{
+	if (rule == NoiseRule::Moon)
 	{
-		// clouds
-		double q = noise(glm::vec3(pos) * 0.01f, 4, 0.5f, 0.5f, false);
-		if (q < -0.35) return Block::cloud;
+		return (q >= 0.6) ? ore_block(pos) : Block::stone;
 	}
-	else if (pos.z <= g_heightmap->Height(pos.x, pos.y))
+	if (rule == NoiseRule::Cloud)
+	{
+		return (q < -0.35) ? Block::cloud : Block::none;
+	}
+	// ground and caves
+	if (q >= 0.6) return ore_block(pos);
+	if (q >= -0.25)
+	{
+		int d = c.height - pos.z;
+		Block b = c.color;
+		if (d > 3 && is_sand(b)) b = Block::dirt;
+		return b;
+	}
+	return Block::none;
+}
+
+struct NoiseBatch
+{
+	Blocks trees; // trunks and leaves stamped from tile's tree list
+
+	// blocks waiting for noise
+	int count;
+	uint16_t index[ChunkSize3];
+	NoiseRule rule[ChunkSize3];
+	uint16_t point[ChunkSize3]; // only for exact noise
+
+	// points to evaluate (exact blocks, then lattices)
+	int points;
+	float x[ChunkSize3 + 2 * LatticeSize * LatticeSize * LatticeSize];
+	float y[ChunkSize3 + 2 * LatticeSize * LatticeSize * LatticeSize];
+	float z[ChunkSize3 + 2 * LatticeSize * LatticeSize * LatticeSize];
+	float q[ChunkSize3 + 2 * LatticeSize * LatticeSize * LatticeSize];
+
+	int add_point(glm::ivec3 pos, float scale)
+	{
+		glm::vec3 p = glm::vec3(pos) * scale;
+		x[points] = p.x;
+		y[points] = p.y;
+		z[points] = p.z;
+		return points++;
+	}
+};
+
+// true if any block of chunk at base is inside sphere
+bool chunk_intersects_sphere(glm::ivec3 base, glm::ivec3 center, int radius)
+{
+	glm::ivec3 d = glm::clamp(center, base, base + ChunkSize - 1) - center;
+	return sqr<int64_t>(d.x) + sqr<int64_t>(d.y) + sqr<int64_t>(d.z) <= sqr<int64_t>(radius);
+}
+
+// Stamps trees of tile into chunk at height base_z. Returns false (without touching out) if there are none.
+// If columns of two trees overlap, the first tree wins (trunk and leaves of same tree never overlap).
+bool stamp_trees(const ColumnTile& tile, int base_z, Blocks& out)
+{
+	bool empty = true;
+	for (const TreeSpot& t : tile.trees)
 	{
-		// ground and caves
-		double q = noise(glm::vec3(pos) * 0.03f, 4, 0.5f, 0.5f, false);
-		static Block ores[6] = { Block::gold_ore, Block::coal_ore, Block::diamond_ore, Block::redstone_ore, Block::emerald_ore, Block::lapis_ore};
-		if (q >= 0.6) return ores[uint(pos.x ^ pos.y ^ pos.z) / 3 % 6];
-		if (q >= -0.25)
+		if (t.height + 5 < base_z || t.height + 1 >= base_z + ChunkSize) continue;
+		if (empty)
 		{
-			int d = g_heightmap->Height(pos.x, pos.y) - pos.z;
-			Block b = g_heightmap->Color(pos.x, pos.y);
-			if (d > 3 && is_sand(b)) b = Block::dirt;
-			return b;
+			memset(out.data(), 0, sizeof(Block) * ChunkSize3);
+			empty = false;
 		}
+		auto stamp = [&](int x, int y, int z0, int z1, Block b) {
+			if (x < 0 || y < 0 || x >= ChunkSize || y >= ChunkSize) return;
+			FOR2(z, std::max(z0, base_z), std::min(z1, base_z + ChunkSize - 1))
+			{
+				Block& e = out[glm::ivec3(x, y, z - base_z)];
+				if (e == Block::none) e = b;
+			}
+		};
+		stamp(t.x, t.y, t.height + 1, t.height + 5, t.trunk);
+		stamp(t.x, t.y - 1, t.height + 3, t.height + 5, t.leaves);
+		stamp(t.x, t.y + 1, t.height + 3, t.height + 5, t.leaves);
+		stamp(t.x - 1, t.y, t.height + 3, t.height + 5, t.leaves);
+		stamp(t.x + 1, t.y, t.height + 3, t.height + 5, t.leaves);
 	}
-
-	return Block::none;
+	return !empty;
 }
 
+// Thread safe
 void generate_chunk(XCube<ChunkSize, Block>& chunk, glm::ivec3 cpos)
 {
-	g_heightmap->Populate(cpos.x, cpos.y);
-	FOR(x, ChunkSize) FOR(y, ChunkSize) FOR(z, ChunkSize)
+	std::shared_ptr<const ColumnTile> tile = g_column_cache.get(glm::ivec2(cpos));
+	glm::ivec3 base = cpos * ChunkSize;
+
+	// most chunks are sky
+	static_assert(uint(Block::none) == 0, "");
+	bool clouds = base.z + ChunkSize > CloudMin && base.z <= CloudMax;
+	if (base.z > std::max(tile->top, 3/*showcase and water source*/) && !clouds && !chunk_intersects_sphere(base, MoonCenter, MoonRadius))
 	{
+		memset(chunk.data(), 0, sizeof(Block) * ChunkSize3);
+		return;
+	}
+
+	std::unique_ptr<Column[]> columns(new Column[ChunkSize2]);
+	FOR(y, ChunkSize) FOR(x, ChunkSize)
+	{
+		columns[y * ChunkSize + x] = generate_column(*tile, x, y, glm::ivec2(base));
+	}
+
+	// read once, so that whole chunk uses the same sampling even if toggled meanwhile
+	bool exact_ground = g_exact_ground_noise.load(std::memory_order_relaxed);
+	bool exact_cloud = g_exact_cloud_noise.load(std::memory_order_relaxed);
+
+	std::unique_ptr<NoiseBatch> batch(new NoiseBatch);
+	batch->count = 0;
+	batch->points = 0;
+	bool has_trees = stamp_trees(*tile, base.z, batch->trees);
+	bool need_ground = false, need_cloud = false;
+
+	// below ground of all columns, and away from crater, moon and showcase, every block is ground or cave from noise
+	bool underground = base.z + ChunkSize - 1 <= tile->min_height && !has_trees && !clouds && (base.z > 3 || base.z + ChunkSize <= 0)
+		&& !chunk_intersects_sphere(base, CraterCenter, CraterRadius) && !chunk_intersects_sphere(base, MoonCenter, MoonRadius);
+
+	FOR(z, ChunkSize) FOR(y, ChunkSize) FOR(x, ChunkSize)
+	{
+		const Column& c = columns[y * ChunkSize + x];
 		glm::ivec3 v(x, y, z);
-		chunk[v] = generate_block(cpos * ChunkSize + v);
+		glm::ivec3 pos = base + v;
+		NoiseRule rule;
+		if (underground)
+		{
+			chunk[v] = Block::none;
+			rule = NoiseRule::Ground;
+		}
+		else
+		{
+			if (pos.z > c.top && (pos.z < CloudMin || pos.z > CloudMax))
+			{
+				chunk[v] = Block::none;
+				continue;
+			}
+			chunk[v] = generate_block(pos, c, has_trees ? batch->trees[v] : Block::none, rule);
+			if (rule == NoiseRule::None) continue;
+		}
+
+		int i = batch->count++;
+		batch->index[i] = block_index(v);
+		batch->rule[i] = rule;
+		if (rule == NoiseRule::Cloud)
+		{
+			need_cloud = true;
+			if (exact_cloud) batch->point[i] = batch->add_point(pos, CloudNoiseScale);
+		}
+		else
+		{
+			need_ground = true;
+			if (exact_ground) batch->point[i] = batch->add_point(pos, GroundNoiseScale);
+		}
+	}
+
+	int ground_lattice = batch->points;
+	if (need_ground && !exact_ground)
+	{
+		FOR(z, LatticeSize) FOR(y, LatticeSize) FOR(x, LatticeSize) batch->add_point(base + glm::ivec3(x, y, z) * LatticeStep, GroundNoiseScale);
+	}
+	int cloud_lattice = batch->points;
+	if (need_cloud && !exact_cloud)
+	{
+		FOR(z, LatticeSize) FOR(y, LatticeSize) FOR(x, LatticeSize) batch->add_point(base + glm::ivec3(x, y, z) * LatticeStep, CloudNoiseScale);
+	}
+
+	noise(batch->x, batch->y, batch->z, batch->q, batch->points, 4, 0.5f, 0.5f, false);
+	FOR(i, batch->count)
+	{
+		glm::ivec3 v = block_position(batch->index[i]);
+		NoiseRule rule = batch->rule[i];
+		float q;
+		if (rule == NoiseRule::Cloud)
+		{
+			q = exact_cloud ? batch->q[batch->point[i]] : lattice_sample(batch->q + cloud_lattice, v);
+		}
+		else
+		{
+			q = exact_ground ? batch->q[batch->point[i]] : lattice_sample(batch->q + ground_lattice, v);
+		}
+		chunk[v] = generate_block(base + v, columns[v.y * ChunkSize + v.x], rule, q);
 	}
 }